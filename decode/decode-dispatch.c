@@ -0,0 +1,37 @@
+#include "decode.h"
+#include "types.h"
+
+// Runtime selection of the widest lz4_decode_block_simd_* the CPU supports.
+// The choice is made once at startup - lz4_decode_block_simd() is then just an
+//   indirect call.
+
+static lz4_decode_block_fn* lz4_decode_block_simd_impl = lz4_decode_block_fast;
+static const char* lz4_decode_block_simd_impl_name = "fast";
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((constructor))
+static void lz4_decode_block_simd_init(void) {
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx512f")) {
+    lz4_decode_block_simd_impl = lz4_decode_block_simd_avx512;
+    lz4_decode_block_simd_impl_name = "avx512";
+  } else if(__builtin_cpu_supports("avx2")) {
+    lz4_decode_block_simd_impl = lz4_decode_block_simd_avx2;
+    lz4_decode_block_simd_impl_name = "avx2";
+  } else if(__builtin_cpu_supports("sse2")) {
+    lz4_decode_block_simd_impl = lz4_decode_block_simd_sse2;
+    lz4_decode_block_simd_impl_name = "sse2";
+  }
+}
+
+#endif //x86
+
+ssize_t lz4_decode_block_simd(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  return lz4_decode_block_simd_impl(out_void, out_len, in_void, in_len);
+}
+
+const char* lz4_decode_block_simd_name(void) {
+  return lz4_decode_block_simd_impl_name;
+}
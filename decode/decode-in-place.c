@@ -0,0 +1,130 @@
+#include <stdint.h>
+// memmove
+#include <string.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// In-place block decoder - the compressed block sits at the end of its own output buffer.
+//
+// Output is written from the start of the buffer towards the unread input. The fast loop
+//   is run with its output limit set at the start of the unread input, so none of its
+//   speculative writes - the 16-byte literals and 2x16-byte match copies - can reach
+//   input that has not been read yet. Each time the fast loop stops, one sequence is
+//   decoded exactly, which moves the unread input on and lets the fast loop continue.
+//
+// The output never overtakes the input provided the buffer has LZ4_DECODE_IN_PLACE_MARGIN()
+//   bytes beyond the decompressed size. Compressed data that is longer than the data it
+//   decodes to can only come from literals, at 1 extra byte per 255 literals plus the
+//   token and offset bytes of a few sequences.
+
+// Decode one sequence exactly, with output not allowed to pass the unread input.
+// @return 0 for a sequence with a match, 1 for the last sequence of the block, or -ve error val
+static ssize_t decode_sequence_in_place(u8* window_start, u8** out_p, const u8** in_p, const u8* in_limit) {
+  u8* out = *out_p;
+  const u8* in = *in_p;
+
+  u8 lits_len_match_len_token = *in++;
+  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+  size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+  if(lits_len == LONG_LITS_LEN) {
+    u8 lits_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+    } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+  }
+
+  if((size_t)(in_limit - in) < lits_len) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  // out is never after in so this can only overwrite literals already copied.
+  memmove(out, in, lits_len);
+  out += lits_len;
+  in += lits_len;
+
+  if(in == in_limit) {
+    // The last sequence in a block does not have a match
+    *out_p = out;
+    *in_p = in;
+    return 1;
+  }
+
+  if((size_t)(in_limit - in) < MATCH_OFFSET_LEN) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  size_t match_offset = (size_t)in[0] + (((size_t)in[1]) << 8);
+  in += MATCH_OFFSET_LEN;
+
+  if((size_t)(out - window_start) < match_offset) {
+    return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+  }
+
+  if(match_len == LONG_MATCH_LEN) {
+    u8 match_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      match_len_extension = *in++;
+      match_len += match_len_extension;
+    } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+  }
+
+  // The match must end before the input that is still to be read - this only fails
+  //   if the buffer is smaller than LZ4_DECODE_IN_PLACE_BUF_LEN() or the block is corrupt.
+  if((size_t)(in - out) < match_len) {
+    return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+  }
+
+  *out_p = lz4_copy_match(out, out - match_offset, match_len);
+  *in_p = in;
+  return 0;
+}
+
+// Limitations:
+// Assumes non-aligned memory accesses work with primitive C integer types - undefined officially
+// Assumes little-endian
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_in_place(void* buf_void, const size_t buf_len, const size_t in_len) {
+  if(buf_len < in_len) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  u8* out_start = (u8*)buf_void;
+  u8* out = out_start;
+
+  const u8* in = out_start + (buf_len - in_len);
+  const u8* in_limit = out_start + buf_len;
+
+  while(in < in_limit) {
+    // The unread input is the output limit, re-evaluated as the input is consumed.
+    ssize_t rc = lz4_decode_sequences_fast(out_start, &out, (u8*)in, &in, in_limit);
+    if(rc < 0) {
+      return rc;
+    }
+
+    if(in == in_limit) {
+      // Blocks end with a literals-only sequence, which is never decoded by the fast loop
+      return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+    }
+
+    rc = decode_sequence_in_place(out_start, &out, &in, in_limit);
+    if(rc < 0) {
+      return rc;
+    }
+
+    if(rc == 1) {
+      break;
+    }
+  }
+
+  return out - out_start;
+}
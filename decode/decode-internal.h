@@ -0,0 +1,295 @@
+#ifndef DECODE_INTERNAL_H
+#define DECODE_INTERNAL_H
+
+// Definitions shared between the decoder implementations - not part of the public API.
+
+#include <string.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "decode.h"
+#include "types.h"
+
+// Speculatively read and write up to 16 bytes of lits
+#define LITS_LOOKAHEAD (16)
+
+// Speculatively read ahead 1 byte of long lit
+#define LONG_LIT_LOOKAHEAD (1)
+
+// Speculatively read and write up to 16 bytes of match
+#define MATCH_LOOKAHEAD (16)
+
+// sizeof lit-len/match-len token in lz4 sequence
+#define LITS_LEN_MATCH_LEN_TOKEN_SIZE (1)
+
+// bit width of LITS_LEN in token
+#define LITS_LEN_BITS (4)
+// distinguished value for "long lits"
+#define LONG_LITS_LEN (15)
+// distinguished length extension value for "long lits"
+#define LITS_LEN_EXTENSION_EXTRA (255)
+
+// Speculatively read ahead 1 byte of long lit
+#define LONG_MATCH_LOOKAHEAD (1)
+
+// bit-mask of MATCH_LEN in token
+#define MATCH_LEN_MASK (0xf)
+// MATCH_LEN offset - minimum match len is 4
+#define MATCH_LEN_MIN (4)
+// distinguished value for "long lits"
+#define LONG_MATCH_LEN (15 + MATCH_LEN_MIN)
+// distinguished length extension value for "long match"
+#define MATCH_LEN_EXTENSION_EXTRA (255)
+
+// sizeof match offset in lz4 sequence
+#define MATCH_OFFSET_LEN (2)
+
+// Total speculative look-ahead on input buffer
+#define IN_LOOKAHEAD (LITS_LEN_MATCH_LEN_TOKEN_SIZE + LITS_LOOKAHEAD + LONG_LIT_LOOKAHEAD + MATCH_OFFSET_LEN + LONG_MATCH_LOOKAHEAD)
+
+// Total speculative look-ahead on output buffer.
+// A short match (no length extension) can be up to 18 bytes, which is written as two
+//   16-byte steps by the long match and overlap fill loops.
+#define OUT_LOOKAHEAD (LITS_LOOKAHEAD + 2*MATCH_LOOKAHEAD)
+
+
+// TODO
+#define xCONFIG_USE_LIKELY
+#define register
+
+#ifdef CONFIG_USE_LIKELY
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
+#endif //def CONFIG_USE_LIKELY
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline size_t token_to_lits_len(u8 token) {
+  return token >> LITS_LEN_BITS;
+}
+
+static inline size_t token_to_match_len(u8 token) {
+  return (token & MATCH_LEN_MASK) + MATCH_LEN_MIN;
+}
+
+// Overlap fill tables for match offsets < 16 - see lz4_overlap_fill().
+// lz4_overlap_shuffle[offset][i] == i % offset
+extern const u8 lz4_overlap_shuffle[16][16];
+// lz4_overlap_step[offset] is the largest multiple of offset <= 16
+extern const u8 lz4_overlap_step[16];
+
+#if !defined(__SSSE3__) && (defined(__x86_64__) || defined(__i386__))
+// Decoders built for plain x86-64 still expand patterns with pshufb where the CPU has
+//   SSSE3 - out of line, as it can not be inlined into code built without SSSE3.
+#define LZ4_OVERLAP_FILL_SSSE3
+// Set at startup if the CPU has SSSE3
+extern int lz4_overlap_fill_use_ssse3;
+extern void lz4_overlap_fill_ssse3(u8* out, const u8* match, u8* out_match_limit);
+#endif
+
+// Fill [out, out_match_limit) from an overlapping match with 1 <= offset < 16.
+// The offset-byte pattern is expanded to 16 bytes with a shuffle, then written 16 bytes
+//   at a time, advancing by a whole number of patterns each step so that the same
+//   16-byte vector stays in phase.
+// Writes up to 15 bytes past out_match_limit, and reads 16 bytes from match.
+static inline void lz4_overlap_fill(u8* out, const u8* match, u8* out_match_limit) {
+  size_t offset = out - match;
+  size_t step = lz4_overlap_step[offset];
+
+#ifdef LZ4_OVERLAP_FILL_SSSE3
+  if(likely(lz4_overlap_fill_use_ssse3)) {
+    lz4_overlap_fill_ssse3(out, match, out_match_limit);
+    return;
+  }
+#endif
+
+#ifdef __SSSE3__
+  __m128i pattern = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)match),
+				     _mm_loadu_si128((const __m128i*)lz4_overlap_shuffle[offset]));
+  do {
+    _mm_storeu_si128((__m128i*)out, pattern);
+    out += step;
+  } while(out < out_match_limit);
+#else
+  const u8* shuffle = lz4_overlap_shuffle[offset];
+  u8 pattern_bytes[16];
+  for(int i = 0; i < 16; i++) {
+    pattern_bytes[i] = match[shuffle[i]];
+  }
+  u64 pattern1, pattern2;
+  memcpy(&pattern1, pattern_bytes, sizeof(u64));
+  memcpy(&pattern2, pattern_bytes + sizeof(u64), sizeof(u64));
+  do {
+    *(u64*)(out+0) = pattern1;
+    *(u64*)(out+sizeof(u64)) = pattern2;
+    out += step;
+  } while(out < out_match_limit);
+#endif //def __SSSE3__
+}
+
+// Copy a match of any length and offset 1 or more, 16 bytes at a time.
+// Writes up to 15 bytes past out_match_limit.
+static inline void lz4_copy_match_speculative(u8* out, const u8* match, u8* out_match_limit) {
+  size_t match_offset = out - match;
+
+  if(likely(match_offset >= 16)) {
+    do {
+      memcpy(out, match, 16);
+      match += 16;
+      out += 16;
+    } while(out < out_match_limit);
+  } else if(match_offset >= sizeof(u64)) {
+    // Overlap of 8-15 bytes - copy u64 (8 bytes) at a time.
+    do {
+      memcpy(out, match, sizeof(u64));
+      memcpy(out + sizeof(u64), match + sizeof(u64), sizeof(u64));
+      match += 16;
+      out += 16;
+    } while(out < out_match_limit);
+  } else if(likely(match_offset == 1)) {
+    // Byte fill dominates the short offsets.
+    u64 match_pattern = ((u64)*match) * 0x0101010101010101UL;
+    do {
+      memcpy(out, &match_pattern, sizeof(u64));
+      memcpy(out + sizeof(u64), &match_pattern, sizeof(u64));
+      out += 16;
+    } while(out < out_match_limit);
+  } else {
+    lz4_overlap_fill(out, match, out_match_limit);
+  }
+}
+
+// Copy a match exactly, with no speculative writes.
+// @return out after the match
+static inline u8* lz4_copy_match(u8* out, const u8* match, size_t match_len) {
+  if((size_t)(out - match) >= match_len) {
+    memcpy(out, match, match_len);
+    return out + match_len;
+  }
+
+  // Overlapping match repeats the pattern of (out - match) bytes - memmove() would
+  //   copy the original (not yet written) bytes instead, so copy forwards byte-wise.
+  u8* out_match_limit = out + match_len;
+  while(out < out_match_limit) {
+    *out++ = *match++;
+  }
+  return out;
+}
+
+// Copy a match exactly that starts dict_back bytes before the end of the external
+//   dictionary, continuing from window_start if it is longer than dict_back.
+// @return out after the match
+static inline u8* lz4_copy_dict_match(u8* out, u8* window_start, const u8* dict, size_t dict_len, size_t dict_back, size_t match_len) {
+  size_t dict_match_len = dict_back < match_len ? dict_back : match_len;
+
+  memcpy(out, dict + dict_len - dict_back, dict_match_len);
+  out += dict_match_len;
+
+  return lz4_copy_match(out, window_start, match_len - dict_match_len);
+}
+
+// Sampled statistics counters - see lz4_decode_stats in decode.h.
+// A decoder loop decides whether it is sampled with LZ4_STATS_SAMPLE() once per call,
+//   and then records each sequence, if sampled, with one of the other macros. Deciding
+//   per sequence would put a thread-local read-modify-write on the critical path of
+//   every sequence. Without -DLZ4_DECODE_STATS the macros compile to nothing.
+#ifdef LZ4_DECODE_STATS
+
+// Counters of the calling thread
+extern __thread lz4_decode_stats lz4_stats;
+// Decoder loops until the next sample on the calling thread
+extern __thread u32 lz4_stats_countdown;
+// Shared by all threads - see lz4_decode_stats_set_sample_rate()
+extern u32 lz4_stats_sample_rate;
+
+// @return 1 if the current call of a decoder loop is sampled
+static inline int lz4_stats_sample(void) {
+  if(likely(--lz4_stats_countdown != 0)) {
+    return 0;
+  }
+  u32 sample_rate = __atomic_load_n(&lz4_stats_sample_rate, __ATOMIC_RELAXED);
+  // With sampling stopped, check again on the next call
+  lz4_stats_countdown = sample_rate != 0 ? sample_rate : 1;
+  return sample_rate != 0;
+}
+
+static inline size_t lz4_stats_len_bucket(size_t len) {
+  return len < LZ4_STATS_LEN_BUCKETS - 1 ? len : LZ4_STATS_LEN_BUCKETS - 1;
+}
+
+static inline size_t lz4_stats_offset_bucket(size_t offset) {
+  // Offsets 16-31 are bucket 16, up to 32768-65535 in bucket 27
+  return offset < 16 ? offset : 12 + (63 - __builtin_clzl(offset));
+}
+
+static inline void lz4_stats_sequence(u64* how, size_t lits_len, size_t match_len, size_t match_offset) {
+  lz4_stats.sequences++;
+  (*how)++;
+  lz4_stats.lits_len[lz4_stats_len_bucket(lits_len)]++;
+  lz4_stats.match_len[lz4_stats_len_bucket(match_len)]++;
+  lz4_stats.match_offset[lz4_stats_offset_bucket(match_offset)]++;
+}
+
+static inline void lz4_stats_lits(u64* how, size_t lits_len) {
+  lz4_stats.sequences++;
+  (*how)++;
+  lz4_stats.lits_len[lz4_stats_len_bucket(lits_len)]++;
+}
+
+#define LZ4_STATS_SAMPLE() lz4_stats_sample()
+// A sequence with a match, by how it was copied - how is a lz4_decode_stats field
+#define LZ4_STATS_SEQUENCE(sampled, how, lits_len, match_len, match_offset) \
+  do { if(unlikely(sampled)) lz4_stats_sequence(&lz4_stats.how, (lits_len), (match_len), (match_offset)); } while(0)
+// The last sequence of a block, which has literals only
+#define LZ4_STATS_LITS(sampled, how, lits_len) \
+  do { if(unlikely(sampled)) lz4_stats_lits(&lz4_stats.how, (lits_len)); } while(0)
+#define LZ4_STATS_OVERLAP_FILL(sampled, match_offset) \
+  do { if(unlikely(sampled)) lz4_stats.overlap_fill[(match_offset) & 0xf]++; } while(0)
+#define LZ4_STATS_BAIL() \
+  do { lz4_stats.bails++; } while(0)
+
+#else
+
+#define LZ4_STATS_SAMPLE() (0)
+#define LZ4_STATS_SEQUENCE(sampled, how, lits_len, match_len, match_offset) ((void)(sampled))
+#define LZ4_STATS_LITS(sampled, how, lits_len) ((void)(sampled))
+#define LZ4_STATS_OVERLAP_FILL(sampled, match_offset) ((void)(sampled))
+#define LZ4_STATS_BAIL() ((void)0)
+
+#endif //def LZ4_DECODE_STATS
+
+/**
+ * Decode sequences with no speculative look-ahead, starting at out.
+ * Matches may reach back as far as window_start, which is typically the start of
+ *   the output block - this is what lets the fast decoders bail to this for the end
+ *   of the block without losing the output decoded so far.
+ * Matches reaching back beyond window_start continue into the dict_len bytes of
+ *   external dictionary, which is logically immediately before window_start.
+ * Stops at the end of the first sequence that reaches target_len bytes of output -
+ *   SIZE_MAX to decode all of the input.
+ * @return size of data decoded from out or -ve error code
+ */
+extern ssize_t lz4_decode_sequences_default(u8* window_start, const u8* dict, const size_t dict_len, u8* out, const size_t out_len, const size_t target_len, const u8* in, const size_t in_len);
+
+/**
+ * Decode whole sequences with the speculative fast loop of lz4_decode_block_fast().
+ * Stops at the start of the first sequence that might need more look-ahead than in
+ *   or out have left, so unlike the block decoders it never assumes that the input
+ *   ends at the end of the block.
+ * Matches may reach back as far as window_start.
+ * @return 0 with *out_p and *in_p advanced, or -ve error code
+ */
+extern ssize_t lz4_decode_sequences_fast(u8* window_start, u8** out_p, u8* out_limit, const u8** in_p, const u8* in_limit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ndef DECODE_INTERNAL_H
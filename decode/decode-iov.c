@@ -0,0 +1,350 @@
+#include <stdint.h>
+// memcpy
+#include <string.h>
+#include <sys/uio.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// Scatter output decoder - output goes to a list of iovec segments, such as pages that
+//   are not contiguous in memory.
+//
+// A sequence whose output stays within the current segment, with room for the
+//   speculative copies, is decoded as by lz4_decode_block_fast(). A match from an earlier
+//   segment is copied exactly, since speculative reads could run off the end of its
+//   segment. Anything else - a sequence running into the next segment, a match source
+//   that spans a segment boundary, and the end of the block - is decoded exactly, and
+//   copied piecewise across the segment boundaries.
+
+// Output position in the segments.
+typedef struct iov_out {
+  const struct iovec* iov;
+  int iovcnt;
+
+  // Current segment, -1 before the first
+  int seg;
+  u8* seg_start;
+  u8* seg_limit;
+  // Total length of the segments before seg
+  size_t seg_pos;
+
+  u8* out;
+
+  // log2 of the segment length when all segments but the last are the same power of 2
+  //   long, as for pages, so that a position maps straight to its segment - else -1.
+  int seg_len_shift;
+
+  // Segment of the last match from an earlier segment, where the search for the next
+  //   one starts if the segments are not all the same length.
+  int match_seg;
+  size_t match_seg_pos;
+} iov_out;
+
+// @return log2 of the length of all segments but the last, if that is a power of 2, else -1
+static int uniform_seg_len_shift(const struct iovec* iov, const int iovcnt) {
+  if(iovcnt < 1) {
+    return -1;
+  }
+
+  size_t seg_len = iov[0].iov_len;
+  if(seg_len == 0 || (seg_len & (seg_len - 1)) != 0) {
+    return -1;
+  }
+
+  for(int seg = 1; seg < iovcnt - 1; seg++) {
+    if(iov[seg].iov_len != seg_len) {
+      return -1;
+    }
+  }
+
+  return __builtin_ctzl(seg_len);
+}
+
+// Move on to the next non-empty segment.
+// @return 1, or 0 if there are no more segments
+static int next_segment(iov_out* o) {
+  while(o->seg + 1 < o->iovcnt) {
+    o->seg_pos += o->seg_limit - o->seg_start;
+    o->seg++;
+
+    o->seg_start = o->out = (u8*)o->iov[o->seg].iov_base;
+    o->seg_limit = o->seg_start + o->iov[o->seg].iov_len;
+
+    if(o->seg_start != o->seg_limit) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Find the segment holding output position pos, which must be before the output.
+// Sets o->match_seg and o->match_seg_pos.
+static inline void find_match_segment(iov_out* o, size_t pos) {
+  if(likely(o->seg_len_shift >= 0)) {
+    size_t seg = pos >> o->seg_len_shift;
+    // The last segment can be longer than the rest
+    o->match_seg = seg < (size_t)o->seg ? (int)seg : o->seg;
+    o->match_seg_pos = (size_t)o->match_seg << o->seg_len_shift;
+    return;
+  }
+
+  int seg = o->match_seg;
+  size_t seg_pos = o->match_seg_pos;
+
+  while(pos < seg_pos) {
+    seg--;
+    seg_pos -= o->iov[seg].iov_len;
+  }
+  while(seg_pos + o->iov[seg].iov_len <= pos) {
+    seg_pos += o->iov[seg].iov_len;
+    seg++;
+  }
+
+  o->match_seg = seg;
+  o->match_seg_pos = seg_pos;
+}
+
+// Copy literals piecewise across segments.
+// @return 0 or -ve error val
+static ssize_t copy_lits(iov_out* o, const u8* lits, size_t lits_len) {
+  while(lits_len != 0) {
+    if(o->out == o->seg_limit && !next_segment(o)) {
+      return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+    }
+
+    size_t room = o->seg_limit - o->out;
+    size_t len = lits_len < room ? lits_len : room;
+
+    memcpy(o->out, lits, len);
+    o->out += len;
+    lits += len;
+    lits_len -= len;
+  }
+  return 0;
+}
+
+// Copy a match piecewise across segments - both the source and the output can cross
+//   segment boundaries.
+// @return 0 or -ve error val
+static ssize_t copy_match(iov_out* o, size_t match_offset, size_t match_len) {
+  size_t pos = o->seg_pos + (o->out - o->seg_start);
+
+  if(match_offset == 0 || pos < match_offset) {
+    return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+  }
+
+  size_t match_pos = pos - match_offset;
+  find_match_segment(o, match_pos);
+
+  int match_seg = o->match_seg;
+  const u8* match = (const u8*)o->iov[match_seg].iov_base + (match_pos - o->match_seg_pos);
+  const u8* match_limit = (const u8*)o->iov[match_seg].iov_base + o->iov[match_seg].iov_len;
+
+  while(match_len != 0) {
+    if(o->out == o->seg_limit && !next_segment(o)) {
+      return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+    }
+
+    // The source only runs into segments that have already been written.
+    while(match == match_limit) {
+      match_seg++;
+      match = (const u8*)o->iov[match_seg].iov_base;
+      match_limit = match + o->iov[match_seg].iov_len;
+    }
+
+    size_t room = o->seg_limit - o->out;
+    size_t match_room = match_limit - match;
+    size_t len = match_len < room ? match_len : room;
+    len = len < match_room ? len : match_room;
+
+    if(match_seg == o->seg) {
+      // Source and output can only overlap within one segment
+      o->out = lz4_copy_match(o->out, match, len);
+    } else {
+      memcpy(o->out, match, len);
+      o->out += len;
+    }
+    match += len;
+    match_len -= len;
+  }
+  return 0;
+}
+
+// Decode one sequence exactly.
+// @return 1 after the last sequence of the block, 0 otherwise, or -ve error val
+static ssize_t decode_sequence_exact(iov_out* o, const u8** in_p, const u8* in_limit) {
+  const u8* in = *in_p;
+
+  u8 lits_len_match_len_token = *in++;
+  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+  size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+  if(lits_len == LONG_LITS_LEN) {
+    u8 lits_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+    } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+  }
+
+  if((size_t)(in_limit - in) < lits_len) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  ssize_t rc = copy_lits(o, in, lits_len);
+  if(rc < 0) {
+    return rc;
+  }
+  in += lits_len;
+
+  // The last sequence has no match
+  if(in == in_limit) {
+    *in_p = in;
+    return 1;
+  }
+
+  if((size_t)(in_limit - in) < MATCH_OFFSET_LEN) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  size_t match_offset = in[0] | ((size_t)in[1] << 8);
+  in += MATCH_OFFSET_LEN;
+
+  if(match_len == LONG_MATCH_LEN) {
+    u8 match_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      match_len_extension = *in++;
+      match_len += match_len_extension;
+    } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+  }
+
+  rc = copy_match(o, match_offset, match_len);
+  if(rc < 0) {
+    return rc;
+  }
+
+  *in_p = in;
+  return 0;
+}
+
+// Limitations:
+// Assumes non-aligned memory accesses work with primitive C integer types - undefined officially
+// Assumes little-endian
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_iov(const struct iovec* iov, const int iovcnt, const void* in_void, const size_t in_len) {
+  iov_out o = { iov, iovcnt, -1, 0, 0, 0, 0, uniform_seg_len_shift(iov, iovcnt), 0, 0 };
+
+  const u8* in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+  // Fast limit must not underflow the buffer start
+  const u8* const in_fast_limit = in_len > IN_LOOKAHEAD ? in_limit - IN_LOOKAHEAD : in;
+
+  while(in < in_limit) {
+    if(likely(in < in_fast_limit && (size_t)(o.seg_limit - o.out) > OUT_LOOKAHEAD)) {
+      // Fast mode within the segment
+      u8* const out_fast_limit = o.seg_limit - OUT_LOOKAHEAD;
+      const u8* const seq_in = in;
+      u8* out = o.out;
+
+      u8 lits_len_match_len_token = *in++;
+      size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+      size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+      if(likely(lits_len < LONG_LITS_LEN)) {
+	// Speculatively copy 16 bytes of literals
+	memcpy(out, in, LITS_LOOKAHEAD);
+      } else {
+	u8 lits_len_extension;
+	do {
+	  if(unlikely(in_fast_limit <= in)) {
+	    goto exact;
+	  }
+	  lits_len_extension = *in++;
+	  lits_len += lits_len_extension;
+	} while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA));
+
+	if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
+	  goto exact;
+	}
+
+	memcpy(out, in, lits_len);
+      }
+
+      in += lits_len;
+      out += lits_len;
+
+      size_t match_offset = *(const u16*)in;
+      in += MATCH_OFFSET_LEN;
+
+      if(unlikely(match_len == LONG_MATCH_LEN)) {
+	u8 match_len_extension;
+	do {
+	  if(unlikely(in_fast_limit <= in)) {
+	    goto exact;
+	  }
+	  match_len_extension = *in++;
+	  match_len += match_len_extension;
+	} while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA));
+
+	if(unlikely(out_fast_limit <= out + match_len)) {
+	  goto exact;
+	}
+      }
+
+      u8* out_match_limit = out + match_len;
+
+      // Offset 0 is an error, which the exact decode reports.
+      if(likely(match_offset - 1 < (size_t)(out - o.seg_start))) {
+	lz4_copy_match_speculative(out, out - match_offset, out_match_limit);
+      } else {
+	// The match starts in an earlier segment, so can not overlap the output.
+	size_t pos = o.seg_pos + (out - o.seg_start);
+	if(unlikely(match_offset == 0 || pos < match_offset)) {
+	  goto exact;
+	}
+
+	size_t match_pos = pos - match_offset;
+	find_match_segment(&o, match_pos);
+
+	size_t match_seg_offset = match_pos - o.match_seg_pos;
+	size_t match_room = o.iov[o.match_seg].iov_len - match_seg_offset;
+	const u8* match = (const u8*)o.iov[o.match_seg].iov_base + match_seg_offset;
+
+	if(likely(match_len <= MATCH_LOOKAHEAD && MATCH_LOOKAHEAD <= match_room)) {
+	  // Speculative 16-byte copy that still reads within the match segment
+	  memcpy(out, match, MATCH_LOOKAHEAD);
+	} else if(likely(match_len <= match_room)) {
+	  memcpy(out, match, match_len);
+	} else {
+	  // Runs on into the next segment
+	  goto exact;
+	}
+      }
+
+      o.out = out_match_limit;
+      continue;
+
+    exact:
+      // Back to the start of the sequence - any speculative output is overwritten.
+      in = seq_in;
+    }
+
+    ssize_t rc = decode_sequence_exact(&o, &in, in_limit);
+    if(rc < 0) {
+      return rc;
+    }
+
+    if(rc == 1) {
+      break;
+    }
+  }
+
+  return o.seg_pos + (o.out - o.seg_start);
+}
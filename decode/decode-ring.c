@@ -0,0 +1,212 @@
+#include <stdint.h>
+// memcpy
+#include <string.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+#include "xxhash32.h"
+
+// Bounded-memory decoder for verify-only mode.
+//
+// Output goes into a small buffer that holds the last LZ4_WINDOW_SIZE bytes of
+//   history followed by new output. When the buffer fills, new output is hashed and
+//   the last LZ4_WINDOW_SIZE bytes are slid back to the start of the buffer. History
+//   is therefore always contiguous immediately before out, so a match never has to
+//   wrap around the end of the ring.
+//
+// Whole sequences that fit go through the speculative fast loop. Anything else - the
+//   end of the block, and long literals or matches that would run off the end of the
+//   buffer - is decoded one sequence at a time and copied piecewise, sliding as needed.
+
+void lz4_ring_decode_init(lz4_ring_decode_state* state, void* buf_void, const size_t buf_len, xxh32_state* hash) {
+  state->buf = (u8*)buf_void;
+  state->buf_limit = (u8*)buf_void + buf_len;
+  state->out = (u8*)buf_void;
+  state->history_len = 0;
+  state->total_len = 0;
+  state->hashed = (u8*)buf_void;
+  state->hash = hash;
+}
+
+static void hash_output(lz4_ring_decode_state* state) {
+  if(state->hash) {
+    xxh32_update(state->hash, state->hashed, state->out - state->hashed);
+  }
+  state->hashed = state->out;
+}
+
+// Hash new output and keep only the match window.
+static void slide(lz4_ring_decode_state* state) {
+  hash_output(state);
+
+  size_t keep_len = state->history_len < LZ4_WINDOW_SIZE ? state->history_len : LZ4_WINDOW_SIZE;
+
+  memmove(state->buf, state->out - keep_len, keep_len);
+  state->out = state->buf + keep_len;
+  state->history_len = keep_len;
+  state->hashed = state->out;
+}
+
+void lz4_ring_decode_set_history(lz4_ring_decode_state* state, const void* history_void, const size_t history_len) {
+  // Anything decoded so far has already been hashed at the end of its block.
+  size_t keep_len = history_len < LZ4_WINDOW_SIZE ? history_len : LZ4_WINDOW_SIZE;
+
+  // No history - history_void may be null
+  if(keep_len != 0) {
+    memcpy(state->buf, (const u8*)history_void + (history_len - keep_len), keep_len);
+  }
+  state->out = state->buf + keep_len;
+  state->history_len = keep_len;
+  state->hashed = state->out;
+}
+
+// Copy literals piecewise, sliding as the buffer fills.
+static void copy_lits(lz4_ring_decode_state* state, const u8* lits, size_t lits_len) {
+  while(lits_len != 0) {
+    if(state->out == state->buf_limit) {
+      slide(state);
+    }
+
+    size_t room = state->buf_limit - state->out;
+    size_t len = lits_len < room ? lits_len : room;
+
+    memcpy(state->out, lits, len);
+    state->out += len;
+    state->history_len += len;
+    state->total_len += len;
+    lits += len;
+    lits_len -= len;
+  }
+}
+
+// Copy a match piecewise, sliding as the buffer fills - the match source is always
+//   within the history kept by slide().
+static void copy_match(lz4_ring_decode_state* state, size_t match_offset, size_t match_len) {
+  while(match_len != 0) {
+    if(state->out == state->buf_limit) {
+      slide(state);
+    }
+
+    size_t room = state->buf_limit - state->out;
+    size_t len = match_len < room ? match_len : room;
+
+    state->out = lz4_copy_match(state->out, state->out - match_offset, len);
+    state->history_len += len;
+    state->total_len += len;
+    match_len -= len;
+  }
+}
+
+// Decode one sequence exactly.
+// @return 1 after the last sequence of the block, 0 otherwise, or -ve error val
+static ssize_t decode_sequence_exact(lz4_ring_decode_state* state, const u8** in_p, const u8* in_limit) {
+  const u8* in = *in_p;
+
+  u8 lits_len_match_len_token = *in++;
+  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+  size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+  if(lits_len == LONG_LITS_LEN) {
+    u8 lits_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+    } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+  }
+
+  if((size_t)(in_limit - in) < lits_len) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  copy_lits(state, in, lits_len);
+  in += lits_len;
+
+  // The last sequence has no match
+  if(in == in_limit) {
+    *in_p = in;
+    return 1;
+  }
+
+  if((size_t)(in_limit - in) < MATCH_OFFSET_LEN) {
+    return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+  }
+
+  size_t match_offset = in[0] | ((size_t)in[1] << 8);
+  in += MATCH_OFFSET_LEN;
+
+  if(match_offset == 0 || state->history_len < match_offset) {
+    return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+  }
+
+  if(match_len == LONG_MATCH_LEN) {
+    u8 match_len_extension;
+    do {
+      if(!(in < in_limit)) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+      match_len_extension = *in++;
+      match_len += match_len_extension;
+    } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+  }
+
+  copy_match(state, match_offset, match_len);
+
+  *in_p = in;
+  return 0;
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_ring_decode_block(lz4_ring_decode_state* state, const void* in_void, const size_t in_len) {
+  const u8* in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+
+  u64 total_len_start = state->total_len;
+
+  while(in < in_limit) {
+    // Make room for the fast loop
+    if((size_t)(state->buf_limit - state->out) < LZ4_RING_DECODE_MIN_ROOM) {
+      slide(state);
+    }
+
+    // The history before out is always contiguous, so it is the window as is.
+    u8* out_start = state->out;
+    ssize_t rc = lz4_decode_sequences_fast(state->out - state->history_len, &state->out, state->buf_limit, &in, in_limit);
+
+    if(rc < 0) {
+      // Error code
+      return rc;
+    }
+
+    state->history_len += state->out - out_start;
+    state->total_len += state->out - out_start;
+
+    // The fast loop stopped at a sequence it could not do - do that one exactly.
+    rc = decode_sequence_exact(state, &in, in_limit);
+
+    if(rc < 0) {
+      // Error code
+      return rc;
+    }
+
+    if(rc == 1) {
+      break;
+    }
+  }
+
+  hash_output(state);
+
+  return state->total_len - total_len_start;
+}
+
+// @return in_len
+ssize_t lz4_ring_decode_raw(lz4_ring_decode_state* state, const void* in_void, const size_t in_len) {
+  copy_lits(state, (const u8*)in_void, in_len);
+
+  hash_output(state);
+
+  return in_len;
+}
@@ -0,0 +1,239 @@
+#include <stdint.h>
+#include <stdio.h>
+// memcpy
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// This file is compiled once per instruction set with -DLZ4_SIMD_<isa> and the matching
+//   -m<isa> flag - see parse/Makefile. Only the selected function is defined, and it is
+//   only ever called via the dispatcher in decode-dispatch.c if the CPU supports it.
+//
+// The decoder follows lz4_decode_block_fast() closely - the difference is that the
+//   literals and match copies are done with 16-byte vector moves, and long literals
+//   and long matches are copied WIDE_COPY_LEN bytes at a time.
+
+#if defined(LZ4_SIMD_AVX512)
+
+#define LZ4_DECODE_BLOCK_SIMD lz4_decode_block_simd_avx512
+#define WIDE_COPY_LEN (64)
+
+static inline void wide_copy(u8* dst, const u8* src) {
+  _mm512_storeu_si512((void*)dst, _mm512_loadu_si512((const void*)src));
+}
+
+#elif defined(LZ4_SIMD_AVX2)
+
+#define LZ4_DECODE_BLOCK_SIMD lz4_decode_block_simd_avx2
+#define WIDE_COPY_LEN (32)
+
+static inline void wide_copy(u8* dst, const u8* src) {
+  _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+}
+
+#elif defined(LZ4_SIMD_SSE2)
+
+#define LZ4_DECODE_BLOCK_SIMD lz4_decode_block_simd_sse2
+#define WIDE_COPY_LEN (16)
+
+static inline void wide_copy(u8* dst, const u8* src) {
+  _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+}
+
+#else
+#error "Define one of LZ4_SIMD_SSE2, LZ4_SIMD_AVX2 or LZ4_SIMD_AVX512"
+#endif
+
+static inline void copy16(u8* dst, const u8* src) {
+  _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+}
+
+// A short match (no length extension, <= 18 bytes) is copied in at most two 16-byte
+//   steps, so the widest speculative write is 32 bytes, or WIDE_COPY_LEN if wider.
+#define MATCH_WRITE_LOOKAHEAD (WIDE_COPY_LEN > 32 ? WIDE_COPY_LEN : 32)
+
+// Total speculative look-ahead on input buffer - long literals are read WIDE_COPY_LEN at a time
+#define SIMD_IN_LOOKAHEAD (IN_LOOKAHEAD + WIDE_COPY_LEN)
+
+// Total speculative look-ahead on output buffer
+#define SIMD_OUT_LOOKAHEAD (LITS_LOOKAHEAD + MATCH_WRITE_LOOKAHEAD)
+
+// Limitations:
+// Assumes little-endian
+// @return decoded data length or -ve error val
+ssize_t LZ4_DECODE_BLOCK_SIMD(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  u8* restrict out_start = (u8*)out_void;
+  u8* restrict out = (u8*)out_void;
+  u8* const out_limit = out + out_len;
+
+  const u8* restrict in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+
+  // Output buffer limit for speculative lookahead
+  u8* const out_fast_limit = out_limit - SIMD_OUT_LOOKAHEAD;
+
+  // Input buffer limit for speculative lookahead
+  const u8* const in_fast_limit = in_limit - SIMD_IN_LOOKAHEAD;
+
+  if(unlikely(out_len < SIMD_OUT_LOOKAHEAD || in_len < SIMD_IN_LOOKAHEAD)) {
+    goto slow;
+  }
+
+  while(likely(out < out_fast_limit && in < in_fast_limit)) {
+    const u8* seq_in = in;
+    u8 lits_len_match_len_token = *in++;
+    size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+    size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+    // Speculatively copy 16 bytes of literals assuming lit-len < 15.
+    copy16(out, in);
+
+    in += lits_len;
+    out += lits_len;
+
+    // Speculatively read match offset assuming lit-len < 15.
+    size_t match_offset = *(const u16*)in;
+    in += MATCH_OFFSET_LEN;
+
+    if(unlikely(lits_len == LONG_LITS_LEN)) {
+      // Redo from the lit length extension
+      in = seq_in + LITS_LEN_MATCH_LEN_TOKEN_SIZE;
+      out -= LONG_LITS_LEN;
+
+      // First extension byte is inside the literals look-ahead
+      u8 lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+
+      while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA)) {
+	if(in_fast_limit <= in) {
+	  in = seq_in;
+	  goto slow;
+	}
+	lits_len_extension = *in++;
+	lits_len += lits_len_extension;
+      }
+
+      if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
+	in = seq_in;
+	goto slow;
+      }
+
+      // Wide copy with speculative over-run of up to WIDE_COPY_LEN-1 bytes
+      const u8* lits = in;
+      u8* out_lits = out;
+      u8* out_lits_limit = out + lits_len;
+      do {
+	wide_copy(out_lits, lits);
+	lits += WIDE_COPY_LEN;
+	out_lits += WIDE_COPY_LEN;
+      } while(likely(out_lits < out_lits_limit));
+
+      in += lits_len;
+      out += lits_len;
+
+      match_offset = *(const u16*)in;
+      in += MATCH_OFFSET_LEN;
+    }
+
+    // Compare the offset rather than the match pointer to avoid underflow of out_start.
+    if(unlikely((size_t)(out - out_start) < match_offset)) {
+      return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+    }
+
+    const u8* match = out - match_offset;
+
+    // Fast path - short match with no overlap of the 16-byte copy
+    if(likely(match_offset >= 16)) {
+      copy16(out, match);
+
+      if(likely(match_len <= 16)) {
+	out += match_len;
+	continue;
+      }
+    }
+
+    // Handle match length extension.
+    if(unlikely(match_len == LONG_MATCH_LEN)) {
+      size_t match_len_extension = *in++;
+      match_len += match_len_extension;
+      while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA)) {
+	if(in_fast_limit <= in) {
+	  in = seq_in;
+	  out -= lits_len;
+	  goto slow;
+	}
+	match_len_extension = *in++;
+	match_len += match_len_extension;
+      }
+      if(unlikely(out_fast_limit <= out + match_len)) {
+	in = seq_in;
+	out -= lits_len;
+	goto slow;
+      }
+    }
+
+    u8* out_match_limit = out + match_len;
+
+    if(likely(match_offset >= WIDE_COPY_LEN)) {
+      // No overlap within a wide copy
+      do {
+	wide_copy(out, match);
+	match += WIDE_COPY_LEN;
+	out += WIDE_COPY_LEN;
+      } while(likely(out < out_match_limit));
+    } else if(match_offset >= 16) {
+      // First 16 bytes already copied above
+      match += 16;
+      out += 16;
+      while(likely(out < out_match_limit)) {
+	copy16(out, match);
+	match += 16;
+	out += 16;
+      }
+    } else if(match_offset >= sizeof(u64)) {
+      // Overlap of 8-15 bytes - copy u64 (8 bytes) at a time.
+      do {
+	u64 matches1 = *(const u64*)(match+0);
+	*(u64*)(out+0) = matches1;
+	u64 matches2 = *(const u64*)(match + sizeof(u64));
+	*(u64*)(out+sizeof(u64)) = matches2;
+	match += 16;
+	out += 16;
+      } while(likely(out < out_match_limit));
+    } else if(likely(match_offset == 1)) {
+      // Byte fill - by far the most common short overlap
+      __m128i pattern = _mm_set1_epi8((char)*match);
+      do {
+	_mm_storeu_si128((__m128i*)out, pattern);
+	out += 16;
+      } while(likely(out < out_match_limit));
+    } else {
+      // Short overlap - expand the match_offset-byte pattern with the shuffle tables
+      lz4_overlap_fill(out, match, out_match_limit);
+    }
+
+    // Fix speculative over-run
+    out = out_match_limit;
+  }
+
+  // Slow mode with no speculative look-ahead for end of buffers where speculative
+  //   look-ahead would overrun input or output buffers.
+ slow: {
+    size_t out_so_far = out - out_start;
+    size_t in_so_far = in - (const u8*)in_void;
+
+    // Matches can still reach back into the output decoded by the fast loop.
+    ssize_t slow_rc = lz4_decode_sequences_default(out_start, 0, 0, out, out_len - out_so_far, SIZE_MAX, in, in_len - in_so_far);
+
+    if(slow_rc < 0) {
+      // Error code
+      return slow_rc;
+    }
+
+    return out_so_far + slow_rc;
+  }
+}
@@ -0,0 +1,72 @@
+#include <stdint.h>
+// memset
+#include <string.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// Sampled decoder statistics - the counters and sampling state behind the
+//   LZ4_STATS_* macros of decode-internal.h.
+
+#ifdef LZ4_DECODE_STATS
+
+__thread lz4_decode_stats lz4_stats;
+__thread u32 lz4_stats_countdown = 1;
+u32 lz4_stats_sample_rate = 1;
+
+#endif //def LZ4_DECODE_STATS
+
+int lz4_decode_stats_enabled(void) {
+#ifdef LZ4_DECODE_STATS
+  return 1;
+#else
+  return 0;
+#endif //def LZ4_DECODE_STATS
+}
+
+void lz4_decode_stats_set_sample_rate(const u32 sample_rate) {
+#ifdef LZ4_DECODE_STATS
+  __atomic_store_n(&lz4_stats_sample_rate, sample_rate, __ATOMIC_RELAXED);
+#else
+  (void)sample_rate;
+#endif //def LZ4_DECODE_STATS
+}
+
+void lz4_decode_stats_snapshot(lz4_decode_stats* snapshot) {
+#ifdef LZ4_DECODE_STATS
+  *snapshot = lz4_stats;
+#else
+  memset(snapshot, 0, sizeof(*snapshot));
+#endif //def LZ4_DECODE_STATS
+}
+
+void lz4_decode_stats_reset(void) {
+#ifdef LZ4_DECODE_STATS
+  memset(&lz4_stats, 0, sizeof(lz4_stats));
+#endif //def LZ4_DECODE_STATS
+}
+
+static void merge_counts(u64* dst, const u64* src, const size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    dst[i] += src[i];
+  }
+}
+
+void lz4_decode_stats_merge(lz4_decode_stats* dst, const lz4_decode_stats* src) {
+  dst->sequences += src->sequences;
+
+  dst->fast_short += src->fast_short;
+  dst->fast_long += src->fast_long;
+  dst->fast_overlap += src->fast_overlap;
+  dst->fast_dict += src->fast_dict;
+  dst->slow += src->slow;
+
+  dst->bails += src->bails;
+
+  merge_counts(dst->overlap_fill, src->overlap_fill, sizeof(dst->overlap_fill)/sizeof(u64));
+
+  merge_counts(dst->lits_len, src->lits_len, LZ4_STATS_LEN_BUCKETS);
+  merge_counts(dst->match_len, src->match_len, LZ4_STATS_LEN_BUCKETS);
+  merge_counts(dst->match_offset, src->match_offset, LZ4_STATS_OFFSET_BUCKETS);
+}
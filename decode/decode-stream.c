@@ -0,0 +1,184 @@
+#include <stdint.h>
+// memcpy
+#include <string.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// Resumable block decoder - input arrives in arbitrary chunks.
+//
+// Whole sequences that are well inside the current chunk go through the same fast
+//   loop as lz4_decode_block_fast(). The byte-wise state machine below only handles
+//   sequences that straddle a chunk boundary, and the end of the block.
+
+void lz4_stream_decode_init(lz4_stream_decode_state* state, void* out_void, const size_t out_len, const size_t prefix_len) {
+  // Matches can never reach back further than the lz4 window.
+  size_t window_len = prefix_len < LZ4_WINDOW_SIZE ? prefix_len : LZ4_WINDOW_SIZE;
+
+  state->window_start = (u8*)out_void - window_len;
+  state->out_start = (u8*)out_void;
+  state->out = (u8*)out_void;
+  state->out_limit = (u8*)out_void + out_len;
+
+  state->stage = LZ4_STREAM_STAGE_TOKEN;
+  state->lits_len = 0;
+  state->match_len = 0;
+  state->match_offset = 0;
+}
+
+// @return decoded data length from this chunk or -ve error val
+ssize_t lz4_stream_decode_update(lz4_stream_decode_state* state, const void* in_chunk, const size_t in_chunk_len) {
+  u8* const out_chunk_start = state->out;
+  u8* out = state->out;
+  u8* const out_limit = state->out_limit;
+
+  const u8* in = (const u8*)in_chunk;
+  const u8* const in_limit = in + in_chunk_len;
+
+  size_t lits_len = state->lits_len;
+  size_t match_len = state->match_len;
+  size_t match_offset = state->match_offset;
+
+  int stage = state->stage;
+
+  ssize_t rc = 0;
+
+  // Each stage consumes what it can from the chunk and falls through to the next
+  //   stage once complete - running out of input suspends in the current stage.
+  for(;;) {
+    switch(stage) {
+    case LZ4_STREAM_STAGE_TOKEN: {
+      rc = lz4_decode_sequences_fast(state->window_start, &out, out_limit, &in, in_limit);
+      if(rc < 0) {
+	goto error;
+      }
+
+      if(in == in_limit) {
+	goto suspend;
+      }
+
+      u8 lits_len_match_len_token = *in++;
+      lits_len = token_to_lits_len(lits_len_match_len_token);
+      match_len = token_to_match_len(lits_len_match_len_token);
+
+      stage = lits_len == LONG_LITS_LEN ? LZ4_STREAM_STAGE_LITS_LEN_EXTENSION : LZ4_STREAM_STAGE_LITS;
+      break;
+    }
+
+    case LZ4_STREAM_STAGE_LITS_LEN_EXTENSION: {
+      u8 lits_len_extension;
+      do {
+	if(in == in_limit) {
+	  goto suspend;
+	}
+	lits_len_extension = *in++;
+	lits_len += lits_len_extension;
+      } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+
+      stage = LZ4_STREAM_STAGE_LITS;
+      break;
+    }
+
+    case LZ4_STREAM_STAGE_LITS: {
+      // Partial literal runs are copied as they arrive.
+      size_t in_avail = in_limit - in;
+      size_t chunk_lits_len = lits_len < in_avail ? lits_len : in_avail;
+
+      if((size_t)(out_limit - out) < chunk_lits_len) {
+	rc = -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+	goto error;
+      }
+
+      memcpy(out, in, chunk_lits_len);
+      out += chunk_lits_len;
+      in += chunk_lits_len;
+      lits_len -= chunk_lits_len;
+
+      if(lits_len != 0) {
+	goto suspend;
+      }
+
+      // The last sequence in the block stops here - see lz4_stream_decode_finish().
+      stage = LZ4_STREAM_STAGE_OFFSET_LO;
+      break;
+    }
+
+    case LZ4_STREAM_STAGE_OFFSET_LO:
+      if(in == in_limit) {
+	goto suspend;
+      }
+      match_offset = *in++;
+
+      stage = LZ4_STREAM_STAGE_OFFSET_HI;
+      break;
+
+    case LZ4_STREAM_STAGE_OFFSET_HI:
+      if(in == in_limit) {
+	goto suspend;
+      }
+      match_offset |= ((size_t)*in++) << 8;
+
+      if((size_t)(out - state->window_start) < match_offset) {
+	rc = -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+	goto error;
+      }
+
+      stage = match_len == LONG_MATCH_LEN ? LZ4_STREAM_STAGE_MATCH_LEN_EXTENSION : LZ4_STREAM_STAGE_MATCH;
+      break;
+
+    case LZ4_STREAM_STAGE_MATCH_LEN_EXTENSION: {
+      u8 match_len_extension;
+      do {
+	if(in == in_limit) {
+	  goto suspend;
+	}
+	match_len_extension = *in++;
+	match_len += match_len_extension;
+      } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+
+      stage = LZ4_STREAM_STAGE_MATCH;
+      break;
+    }
+
+    case LZ4_STREAM_STAGE_MATCH:
+      // The match needs no input so is never suspended.
+      if((size_t)(out_limit - out) < match_len) {
+	rc = -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+	goto error;
+      }
+
+      out = lz4_copy_match(out, out - match_offset, match_len);
+
+      stage = LZ4_STREAM_STAGE_TOKEN;
+      break;
+
+    default:
+      // Previous error
+      return -LZ4_DECODE_ERR_STREAM_STATE;
+    }
+  }
+
+ suspend:
+  state->out = out;
+  state->stage = stage;
+  state->lits_len = lits_len;
+  state->match_len = match_len;
+  state->match_offset = match_offset;
+
+  return out - out_chunk_start;
+
+ error:
+  state->stage = LZ4_STREAM_STAGE_ERROR;
+  return rc;
+}
+
+// @return decoded data length of the whole block or -ve error val
+ssize_t lz4_stream_decode_finish(lz4_stream_decode_state* state) {
+  // The block must end after the literals of the last sequence, which has no match.
+  if(state->stage != LZ4_STREAM_STAGE_OFFSET_LO) {
+    return state->stage == LZ4_STREAM_STAGE_ERROR ? -LZ4_DECODE_ERR_STREAM_STATE : -LZ4_DECODE_ERR_INCOMPLETE_SEQUENCE;
+  }
+
+  return state->out - state->out_start;
+}
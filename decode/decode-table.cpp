@@ -0,0 +1,195 @@
+#include <array>
+#include <cstdint>
+// memcpy
+#include <cstring>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// Table-driven version of lz4_decode_block_fast().
+//
+// Instead of comparing the token lengths against LONG_LITS_LEN and the short match limit,
+//   the token indexes a 256-entry table of flags built at compile time. The common case -
+//   short literals and a short match - is then a single test of a flag bit.
+//
+// The lengths themselves still come from a shift and mask of the token. They are on the
+//   critical path from one sequence to the next, where the dependent table load measured
+//   slower than the ALU ops - the flags only feed predicted branches.
+
+namespace {
+
+  // Literals length is LONG_LITS_LEN and followed by extension bytes
+  constexpr u8 TOKEN_LONG_LITS = 0x1;
+  // Match length is LONG_MATCH_LEN and followed by extension bytes
+  constexpr u8 TOKEN_LONG_MATCH = 0x2;
+  // Literals fit in one 16-byte copy and the match in one 16-byte copy
+  constexpr u8 TOKEN_SHORT = 0x4;
+
+  // Width of the speculative copies
+  constexpr size_t COPY_LEN = 16;
+
+  constexpr std::array<u8, 256> make_token_table() {
+    std::array<u8, 256> table = {};
+    for(size_t token = 0; token < 256; token++) {
+      size_t lits_len = token >> LITS_LEN_BITS;
+      size_t match_len = (token & MATCH_LEN_MASK) + MATCH_LEN_MIN;
+
+      u8 flags = 0;
+      if(lits_len == LONG_LITS_LEN) {
+	flags |= TOKEN_LONG_LITS;
+      }
+      if(match_len == LONG_MATCH_LEN) {
+	flags |= TOKEN_LONG_MATCH;
+      }
+      if(lits_len < LONG_LITS_LEN && match_len <= COPY_LEN) {
+	flags |= TOKEN_SHORT;
+      }
+
+      table[token] = flags;
+    }
+    return table;
+  }
+
+  constexpr std::array<u8, 256> token_table = make_token_table();
+
+  static_assert(token_table[0x00] == TOKEN_SHORT, "token 0x00");
+  // 14 literals and a 16-byte match is the largest short sequence
+  static_assert(token_table[0xec] == TOKEN_SHORT, "token 0xec");
+  static_assert(token_table[0xed] == 0, "token 0xed");
+  static_assert(token_table[0xf0] == TOKEN_LONG_LITS, "token 0xf0");
+  static_assert(token_table[0xff] == (TOKEN_LONG_LITS | TOKEN_LONG_MATCH), "token 0xff");
+
+  static inline void copy16(u8* dst, const u8* src) {
+    // Fixed size so compiles to a vector move
+    memcpy(dst, src, COPY_LEN);
+  }
+
+} // namespace
+
+// Limitations:
+// Assumes non-aligned memory accesses work with primitive C integer types - undefined officially
+// Assumes little-endian
+// @return decoded data length or -ve error val
+extern "C" ssize_t lz4_decode_block_table(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  u8* const out_start = (u8*)out_void;
+  u8* out = out_start;
+  u8* const out_limit = out_start + out_len;
+
+  const u8* const in_start = (const u8*)in_void;
+  const u8* in = in_start;
+  const u8* const in_limit = in_start + in_len;
+
+  // Fast limits must not underflow the buffer starts
+  if(out_len > OUT_LOOKAHEAD && in_len > IN_LOOKAHEAD) {
+    u8* const out_fast_limit = out_limit - OUT_LOOKAHEAD;
+    const u8* const in_fast_limit = in_limit - IN_LOOKAHEAD;
+
+    while(likely(out < out_fast_limit && in < in_fast_limit)) {
+      const u8* seq_in = in;
+
+      u8 lits_len_match_len_token = *in++;
+      const u8 token_flags = token_table[lits_len_match_len_token];
+      size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+      size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+      // Speculatively copy 16 bytes of literals - enough unless they are long.
+      copy16(out, in);
+
+      if(likely(token_flags & TOKEN_SHORT)) {
+	// Literals and match are a single copy each
+	in += lits_len;
+	out += lits_len;
+
+	size_t match_offset = *(const u16*)in;
+	in += MATCH_OFFSET_LEN;
+
+	if(unlikely((size_t)(out - out_start) < match_offset)) {
+	  return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+	}
+
+	const u8* match = out - match_offset;
+
+	if(likely(match_offset >= sizeof(u64))) {
+	  memcpy(out, match, sizeof(u64));
+	  memcpy(out + sizeof(u64), match + sizeof(u64), sizeof(u64));
+	} else {
+	  lz4_copy_match_speculative(out, match, out + match_len);
+	}
+
+	out += match_len;
+	continue;
+      }
+
+      if(unlikely(token_flags & TOKEN_LONG_LITS)) {
+	u8 lits_len_extension;
+	do {
+	  if(unlikely(in_fast_limit <= in)) {
+	    in = seq_in;
+	    goto slow;
+	  }
+	  lits_len_extension = *in++;
+	  lits_len += lits_len_extension;
+	} while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA));
+
+	if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
+	  in = seq_in;
+	  goto slow;
+	}
+
+	memcpy(out, in, lits_len);
+      }
+
+      in += lits_len;
+      out += lits_len;
+
+      {
+	size_t match_offset = *(const u16*)in;
+	in += MATCH_OFFSET_LEN;
+
+	if(unlikely((size_t)(out - out_start) < match_offset)) {
+	  return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+	}
+
+	if(token_flags & TOKEN_LONG_MATCH) {
+	  u8 match_len_extension;
+	  do {
+	    if(unlikely(in_fast_limit <= in)) {
+	      in = seq_in;
+	      out -= lits_len;
+	      goto slow;
+	    }
+	    match_len_extension = *in++;
+	    match_len += match_len_extension;
+	  } while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA));
+
+	  if(unlikely(out_fast_limit <= out + match_len)) {
+	    in = seq_in;
+	    out -= lits_len;
+	    goto slow;
+	  }
+	}
+
+	u8* out_match_limit = out + match_len;
+	lz4_copy_match_speculative(out, out - match_offset, out_match_limit);
+
+	// Fix speculative over-run
+	out = out_match_limit;
+      }
+    }
+  }
+
+ slow:
+  // The tail of the block with no look-ahead
+  size_t out_so_far = out - out_start;
+  size_t in_so_far = in - in_start;
+
+  ssize_t slow_rc = lz4_decode_sequences_default(out_start, 0, 0, out, out_len - out_so_far, SIZE_MAX, in, in_len - in_so_far);
+
+  if(slow_rc < 0) {
+    // Error code
+    return slow_rc;
+  }
+
+  return out_so_far + slow_rc;
+}
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cstdint>
+// memcpy
+#include <cstring>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "decode-template.h"
+#include "types.h"
+
+// Compile-time specialised versions of lz4_decode_block_fast().
+//
+// The structure is the same as the C fast decoder - a speculative fast loop followed
+//   by lz4_decode_sequences_default() for the tail of the block - but the choices that
+//   decode.c hardwires are template parameters, so that each instantiation only
+//   contains the code it needs.
+
+namespace Lz4 {
+
+  namespace Decode {
+
+    template <size_t N>
+    static inline void copy_n(u8* dst, const u8* src) {
+      // Fixed size so compiles to vector moves
+      memcpy(dst, src, N);
+    }
+
+    template <size_t LOOKAHEAD, Checks CHECKS, size_t BLOCK_MAX>
+    ssize_t decode_block(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+      static_assert(LOOKAHEAD == 16 || LOOKAHEAD == 32, "LOOKAHEAD must be 16 or 32");
+      static_assert(BLOCK_MAX == 64*1024 || BLOCK_MAX == 256*1024 || BLOCK_MAX == 1024*1024 || BLOCK_MAX == 4*1024*1024,
+		    "BLOCK_MAX must be an lz4 frame block max size");
+
+      constexpr bool HARDENED = CHECKS == Checks::HARDENED;
+
+      // Speculative look-ahead on output - short literals are written LOOKAHEAD bytes at
+      //   a time, and a short match (up to 18 bytes) in at most 32 bytes.
+      constexpr size_t OUT_MARGIN = 2*LOOKAHEAD + 32;
+
+      // Speculative look-ahead on input - token, LOOKAHEAD bytes of literals, offset
+      //   and the first length extension byte, with room to spare.
+      constexpr size_t IN_MARGIN = 2*LOOKAHEAD + 4;
+
+      u8* const out_start = (u8*)out_void;
+      u8* out = out_start;
+      // A block never decodes to more than BLOCK_MAX.
+      u8* const out_limit = out_start + std::min(out_len, BLOCK_MAX);
+
+      const u8* const in_start = (const u8*)in_void;
+      const u8* in = in_start;
+      const u8* const in_limit = in_start + in_len;
+
+      // A block that would compress to more than BLOCK_MAX is stored uncompressed.
+      if(HARDENED && in_len > BLOCK_MAX) {
+	return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+      }
+
+      if((size_t)(out_limit - out_start) > OUT_MARGIN && in_len > IN_MARGIN) {
+	const int sampled = LZ4_STATS_SAMPLE();
+
+	u8* const out_fast_limit = out_limit - OUT_MARGIN;
+	const u8* const in_fast_limit = in_limit - IN_MARGIN;
+
+	while(likely(out < out_fast_limit && in < in_fast_limit)) {
+	  const u8* seq_in = in;
+
+	  u8 lits_len_match_len_token = *in++;
+	  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+	  size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+	  if(likely(lits_len != LONG_LITS_LEN)) {
+	    // Speculatively copy LOOKAHEAD bytes of literals.
+	    copy_n<LOOKAHEAD>(out, in);
+	  } else {
+	    u8 lits_len_extension;
+	    do {
+	      // Well-formed input always has the extension followed by literals and offset.
+	      if(HARDENED && unlikely(in_fast_limit <= in)) {
+		in = seq_in;
+		LZ4_STATS_BAIL();
+		goto slow;
+	      }
+	      lits_len_extension = *in++;
+	      lits_len += lits_len_extension;
+	    } while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA));
+
+	    // The copy below needs look-ahead even for well-formed input.
+	    if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
+	      in = seq_in;
+	      LZ4_STATS_BAIL();
+	      goto slow;
+	    }
+
+	    const u8* lits = in;
+	    u8* out_lits = out;
+	    u8* out_lits_limit = out + lits_len;
+	    do {
+	      copy_n<LOOKAHEAD>(out_lits, lits);
+	      lits += LOOKAHEAD;
+	      out_lits += LOOKAHEAD;
+	    } while(out_lits < out_lits_limit);
+	  }
+
+	  in += lits_len;
+	  out += lits_len;
+
+	  size_t match_offset = *(const u16*)in;
+	  in += MATCH_OFFSET_LEN;
+
+	  // Offset 0 is invalid too.
+	  if(HARDENED && unlikely(match_offset == 0 || (size_t)(out - out_start) < match_offset)) {
+	    return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+	  }
+
+	  if(unlikely(match_len == LONG_MATCH_LEN)) {
+	    u8 match_len_extension;
+	    do {
+	      if(HARDENED && unlikely(in_fast_limit <= in)) {
+		in = seq_in;
+		out -= lits_len;
+		LZ4_STATS_BAIL();
+		goto slow;
+	      }
+	      match_len_extension = *in++;
+	      match_len += match_len_extension;
+	    } while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA));
+
+	    if(unlikely(out_fast_limit <= out + match_len)) {
+	      in = seq_in;
+	      out -= lits_len;
+	      LZ4_STATS_BAIL();
+	      goto slow;
+	    }
+	  }
+
+	  const u8* match = out - match_offset;
+	  u8* out_match_limit = out + match_len;
+
+	  if(likely(match_offset >= LOOKAHEAD)) {
+	    // No overlap within a LOOKAHEAD copy - a short match is one or two copies.
+	    if(lits_len < LONG_LITS_LEN && match_len <= LOOKAHEAD) {
+	      LZ4_STATS_SEQUENCE(sampled, fast_short, lits_len, match_len, match_offset);
+	    } else {
+	      LZ4_STATS_SEQUENCE(sampled, fast_long, lits_len, match_len, match_offset);
+	    }
+	    do {
+	      copy_n<LOOKAHEAD>(out, match);
+	      match += LOOKAHEAD;
+	      out += LOOKAHEAD;
+	    } while(out < out_match_limit);
+	  } else if(LOOKAHEAD > 16 && match_offset >= 16) {
+	    LZ4_STATS_SEQUENCE(sampled, fast_long, lits_len, match_len, match_offset);
+	    do {
+	      copy_n<16>(out, match);
+	      match += 16;
+	      out += 16;
+	    } while(out < out_match_limit);
+	  } else if(match_offset >= sizeof(u64)) {
+	    // Overlap of 8-15 bytes - copy u64 (8 bytes) at a time.
+	    LZ4_STATS_SEQUENCE(sampled, fast_long, lits_len, match_len, match_offset);
+	    do {
+	      copy_n<sizeof(u64)>(out, match);
+	      copy_n<sizeof(u64)>(out + sizeof(u64), match + sizeof(u64));
+	      match += 16;
+	      out += 16;
+	    } while(out < out_match_limit);
+	  } else if(likely(match_offset == 1 || match_offset == 2 || match_offset == 4)) {
+	    // Dominated by byte fill - the pattern is a whole number of u64s.
+	    LZ4_STATS_OVERLAP_FILL(sampled, match_offset);
+	    LZ4_STATS_SEQUENCE(sampled, fast_overlap, lits_len, match_len, match_offset);
+	    u64 match_pattern;
+	    if(likely(match_offset == 1)) {
+	      match_pattern = ((u64)*match) * 0x0101010101010101UL;
+	    } else if(match_offset == 2) {
+	      u16 u16_pattern;
+	      memcpy(&u16_pattern, match, sizeof(u16));
+	      match_pattern = ((u64)u16_pattern) * 0x0001000100010001UL;
+	    } else {
+	      u32 u32_pattern;
+	      memcpy(&u32_pattern, match, sizeof(u32));
+	      match_pattern = (u64)u32_pattern | ((u64)u32_pattern << 32);
+	    }
+	    do {
+	      memcpy(out, &match_pattern, sizeof(u64));
+	      memcpy(out + sizeof(u64), &match_pattern, sizeof(u64));
+	      out += 16;
+	    } while(out < out_match_limit);
+	  } else {
+	    // Offset 3, 5, 6 or 7
+	    LZ4_STATS_OVERLAP_FILL(sampled, match_offset);
+	    LZ4_STATS_SEQUENCE(sampled, fast_overlap, lits_len, match_len, match_offset);
+	    lz4_overlap_fill(out, match, out_match_limit);
+	  }
+
+	  // Fix speculative over-run
+	  out = out_match_limit;
+	}
+      }
+
+    slow:
+      // The tail of the block with no look-ahead, always fully checked.
+      size_t out_so_far = out - out_start;
+
+      ssize_t slow_rc = lz4_decode_sequences_default(out_start, 0, 0, out, (out_limit - out_start) - out_so_far, SIZE_MAX, in, in_limit - in);
+
+      if(slow_rc < 0) {
+	// Error code
+	return slow_rc;
+      }
+
+      return out_so_far + slow_rc;
+    }
+
+#define LZ4_DECODE_TEMPLATE_INSTANTIATE(LOOKAHEAD, CHECKS)		\
+    template ssize_t decode_block<LOOKAHEAD, CHECKS, 64*1024>(void*, const size_t, const void*, const size_t); \
+    template ssize_t decode_block<LOOKAHEAD, CHECKS, 256*1024>(void*, const size_t, const void*, const size_t); \
+    template ssize_t decode_block<LOOKAHEAD, CHECKS, 1024*1024>(void*, const size_t, const void*, const size_t); \
+    template ssize_t decode_block<LOOKAHEAD, CHECKS, 4*1024*1024>(void*, const size_t, const void*, const size_t);
+
+    LZ4_DECODE_TEMPLATE_INSTANTIATE(16, Checks::TRUSTED)
+    LZ4_DECODE_TEMPLATE_INSTANTIATE(16, Checks::HARDENED)
+    LZ4_DECODE_TEMPLATE_INSTANTIATE(32, Checks::TRUSTED)
+    LZ4_DECODE_TEMPLATE_INSTANTIATE(32, Checks::HARDENED)
+
+#undef LZ4_DECODE_TEMPLATE_INSTANTIATE
+
+    // Indexed by block max size code - 4, i.e. 64KiB, 256KiB, 1MiB, 4MiB
+    template <size_t LOOKAHEAD, Checks CHECKS>
+    static lz4_decode_block_fn* const block_decoders[4] = {
+      decode_block<LOOKAHEAD, CHECKS, 64*1024>,
+      decode_block<LOOKAHEAD, CHECKS, 256*1024>,
+      decode_block<LOOKAHEAD, CHECKS, 1024*1024>,
+      decode_block<LOOKAHEAD, CHECKS, 4*1024*1024>,
+    };
+
+    template <size_t LOOKAHEAD>
+    static lz4_decode_block_fn* select_checks(const size_t block_max_index, const Checks checks) {
+      return checks == Checks::TRUSTED ? block_decoders<LOOKAHEAD, Checks::TRUSTED>[block_max_index] : block_decoders<LOOKAHEAD, Checks::HARDENED>[block_max_index];
+    }
+
+    lz4_decode_block_fn* select_block_decoder(const size_t block_max_bytes, const Checks checks, const size_t lookahead) {
+      size_t block_max_index;
+      switch(block_max_bytes) {
+      case 64*1024: block_max_index = 0; break;
+      case 256*1024: block_max_index = 1; break;
+      case 1024*1024: block_max_index = 2; break;
+      case 4*1024*1024: block_max_index = 3; break;
+      default: return nullptr;
+      }
+
+      switch(lookahead) {
+      case 16: return select_checks<16>(block_max_index, checks);
+      case 32: return select_checks<32>(block_max_index, checks);
+      default: return nullptr;
+      }
+    }
+
+  } // namespace Decode
+
+} // namespace Lz4
@@ -0,0 +1,224 @@
+#include <stdint.h>
+// memcpy
+#include <string.h>
+
+#include "decode.h"
+#include "decode-internal.h"
+#include "types.h"
+
+// Two-phase block decoder.
+//
+// Phase one scans a batch of sequences from the token stream into struct-of-arrays
+//   form, doing all of the length extension parsing and bounds checking. Phase two
+//   then runs the literal and match copies for the whole batch in a tight loop with
+//   no parsing and (almost) no data-dependent branches on the input bytes.
+//
+// The idea is that the branch mispredicts of parsing are no longer interleaved with
+//   the copies, and the speculative literals copy of lz4_decode_block_fast() never
+//   has to be backed out.
+
+// Number of sequences parsed per batch
+#define SEQ_BATCH_LEN (128)
+
+// Copies in phase two are done 16 bytes at a time with up to 15 bytes of over-run
+#define COPY_LEN (16)
+
+// Phase one only accepts sequences whose copies leave this much room before the
+//   end of the output buffer.
+#define TWO_PHASE_OUT_LOOKAHEAD (COPY_LEN)
+
+// ... and whose literals leave this much room before the end of the input buffer.
+// This also guarantees the real last sequence of the block is left to the tail.
+#define TWO_PHASE_IN_LOOKAHEAD (COPY_LEN + MATCH_OFFSET_LEN)
+
+typedef struct seq_batch {
+  u32 lits_pos[SEQ_BATCH_LEN];
+  u32 lits_len[SEQ_BATCH_LEN];
+  u32 match_len[SEQ_BATCH_LEN];
+  u16 match_offset[SEQ_BATCH_LEN];
+} seq_batch;
+
+static inline void copy16(u8* dst, const u8* src) {
+  u64 v1, v2;
+  memcpy(&v1, src, sizeof(u64));
+  memcpy(&v2, src + sizeof(u64), sizeof(u64));
+  memcpy(dst, &v1, sizeof(u64));
+  memcpy(dst + sizeof(u64), &v2, sizeof(u64));
+}
+
+// Phase one - parse up to SEQ_BATCH_LEN whole sequences starting at *in_p.
+// Output positions are only tracked, starting at out, to validate match offsets and
+//   output bounds.
+// @return number of sequences parsed, with *in_p advanced past them, or -ve error val
+static ssize_t parse_seq_batch(seq_batch* batch, const u8* in_start, const u8** in_p, const u8* in_parse_limit,
+			       const u8* window_start, const u8* out, const u8* out_parse_limit) {
+  const u8* in = *in_p;
+  ssize_t n_seqs = 0;
+
+  while(n_seqs < SEQ_BATCH_LEN && in < in_parse_limit) {
+    const u8* seq_in = in;
+
+    u8 lits_len_match_len_token = *in++;
+    size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+    size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+    if(unlikely(lits_len == LONG_LITS_LEN)) {
+      u8 lits_len_extension;
+      do {
+	if(unlikely(in_parse_limit <= in)) {
+	  in = seq_in;
+	  goto done;
+	}
+	lits_len_extension = *in++;
+	lits_len += lits_len_extension;
+      } while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA));
+    }
+
+    const u8* lits = in;
+
+    // Leaves room for the 16-byte literals over-run and the match offset
+    if(unlikely((size_t)(in_parse_limit - in) <= lits_len)) {
+      in = seq_in;
+      goto done;
+    }
+    in += lits_len;
+
+    size_t match_offset = *(const u16*)in;
+    in += MATCH_OFFSET_LEN;
+
+    if(unlikely(match_len == LONG_MATCH_LEN)) {
+      u8 match_len_extension;
+      do {
+	if(unlikely(in_parse_limit <= in)) {
+	  in = seq_in;
+	  goto done;
+	}
+	match_len_extension = *in++;
+	match_len += match_len_extension;
+      } while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA));
+    }
+
+    if(unlikely((size_t)(out_parse_limit - out) <= lits_len + match_len)) {
+      in = seq_in;
+      goto done;
+    }
+
+    out += lits_len;
+
+    if(unlikely((size_t)(out - window_start) < match_offset)) {
+      return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+    }
+
+    out += match_len;
+
+    batch->lits_pos[n_seqs] = (u32)(lits - in_start);
+    batch->lits_len[n_seqs] = (u32)lits_len;
+    batch->match_len[n_seqs] = (u32)match_len;
+    batch->match_offset[n_seqs] = (u16)match_offset;
+    n_seqs++;
+  }
+
+ done:
+  *in_p = in;
+  return n_seqs;
+}
+
+// Phase two - execute the copies for a batch of parsed sequences.
+// @return out after the batch
+static u8* execute_seq_batch(const seq_batch* batch, const ssize_t n_seqs, const u8* in_start, u8* out) {
+  for(ssize_t i = 0; i < n_seqs; i++) {
+    const u8* lits = in_start + batch->lits_pos[i];
+    size_t lits_len = batch->lits_len[i];
+    size_t match_len = batch->match_len[i];
+    size_t match_offset = batch->match_offset[i];
+
+    // Literals - nearly always a single copy
+    u8* out_lits = out;
+    u8* out_lits_limit = out + lits_len;
+    do {
+      copy16(out_lits, lits);
+      lits += COPY_LEN;
+      out_lits += COPY_LEN;
+    } while(unlikely(out_lits < out_lits_limit));
+
+    out = out_lits_limit;
+
+    const u8* match = out - match_offset;
+    u8* out_match_limit = out + match_len;
+
+    if(likely(match_offset >= COPY_LEN)) {
+      // No overlap within a 16-byte copy - nearly always a single copy
+      do {
+	copy16(out, match);
+	match += COPY_LEN;
+	out += COPY_LEN;
+      } while(unlikely(out < out_match_limit));
+    } else if(match_offset >= sizeof(u64)) {
+      // Overlap of 8-15 bytes - copy u64 (8 bytes) at a time.
+      do {
+	u64 matches1 = *(const u64*)(match+0);
+	*(u64*)(out+0) = matches1;
+	u64 matches2 = *(const u64*)(match + sizeof(u64));
+	*(u64*)(out+sizeof(u64)) = matches2;
+	match += COPY_LEN;
+	out += COPY_LEN;
+      } while(out < out_match_limit);
+    } else {
+      lz4_overlap_fill(out, match, out_match_limit);
+    }
+
+    // Fix speculative over-run
+    out = out_match_limit;
+  }
+
+  return out;
+}
+
+// Limitations:
+// Assumes non-aligned memory accesses work with primitive C integer types - undefined officially
+// Assumes little-endian
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_two_phase(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  u8* out_start = (u8*)out_void;
+  u8* out = out_start;
+
+  const u8* in_start = (const u8*)in_void;
+  const u8* in = in_start;
+
+  seq_batch batch;
+
+  // Positions in the batch are u32 and buffers too short for the look-ahead go
+  //   straight to the tail.
+  if(out_len > TWO_PHASE_OUT_LOOKAHEAD && in_len > TWO_PHASE_IN_LOOKAHEAD && in_len <= UINT32_MAX) {
+    const u8* in_parse_limit = in_start + in_len - TWO_PHASE_IN_LOOKAHEAD;
+    const u8* out_parse_limit = out_start + out_len - TWO_PHASE_OUT_LOOKAHEAD;
+
+    for(;;) {
+      ssize_t n_seqs = parse_seq_batch(&batch, in_start, &in, in_parse_limit, out_start, out, out_parse_limit);
+
+      if(n_seqs < 0) {
+	// Error code
+	return n_seqs;
+      }
+
+      if(n_seqs == 0) {
+	break;
+      }
+
+      out = execute_seq_batch(&batch, n_seqs, in_start, out);
+    }
+  }
+
+  // The tail of the block with no look-ahead
+  size_t out_so_far = out - out_start;
+  size_t in_so_far = in - in_start;
+
+  ssize_t slow_rc = lz4_decode_sequences_default(out_start, 0, 0, out, out_len - out_so_far, SIZE_MAX, in, in_len - in_so_far);
+
+  if(slow_rc < 0) {
+    // Error code
+    return slow_rc;
+  }
+
+  return out_so_far + slow_rc;
+}
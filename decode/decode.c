@@ -1,74 +1,68 @@
+#include <stdint.h>
 #include <stdio.h>
-// memcpy, memmove
+// memcpy
 #include <string.h>
 
+// __rdtsc, _mm_lfence, and _mm_shuffle_epi8 for lz4_overlap_fill_ssse3()
+#include <x86intrin.h>
+
 #include "decode.h"
+#include "decode-internal.h"
 #include "types.h"
+#include "xxhash32.h"
 
-// Speculatively read and write up to 16 bytes of lits 
-#define LITS_LOOKAHEAD (16)
-
-// Speculatively read ahead 1 byte of long lit
-#define LONG_LIT_LOOKAHEAD (1)
-
-// Speculatively read and write up to 16 bytes of match
-#define MATCH_LOOKAHEAD (16)
-
-// sizeof lit-len/match-len token in lz4 sequence
-#define LITS_LEN_MATCH_LEN_TOKEN_SIZE (1)
-
-// bit width of LITS_LEN in token
-#define LITS_LEN_BITS (4)
-// distinguished value for "long lits"
-#define LONG_LITS_LEN (15)
-// distinguished length extension value for "long lits"
-#define LITS_LEN_EXTENSION_EXTRA (255)
-
-// Speculatively read ahead 1 byte of long lit
-#define LONG_MATCH_LOOKAHEAD (1)
+const u8 lz4_overlap_shuffle[16][16] = {
+  {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 }, // unused
+  {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 },
+  {  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1,  0,  1 },
+  {  0,  1,  2,  0,  1,  2,  0,  1,  2,  0,  1,  2,  0,  1,  2,  0 },
+  {  0,  1,  2,  3,  0,  1,  2,  3,  0,  1,  2,  3,  0,  1,  2,  3 },
+  {  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  0 },
+  {  0,  1,  2,  3,  4,  5,  0,  1,  2,  3,  4,  5,  0,  1,  2,  3 },
+  {  0,  1,  2,  3,  4,  5,  6,  0,  1,  2,  3,  4,  5,  6,  0,  1 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  0,  1,  2,  3,  4,  5,  6,  7 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  0,  1,  2,  3,  4,  5,  6 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  0,  1,  2,  3,  4,  5 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10,  0,  1,  2,  3,  4 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11,  0,  1,  2,  3 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12,  0,  1,  2 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13,  0,  1 },
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,  0 },
+};
 
-// bit-mask of MATCH_LEN in token
-#define MATCH_LEN_MASK (0xf)
-// MATCH_LEN offset - minimum match len is 4
-#define MATCH_LEN_MIN (4)
-// distinguished value for "long lits"
-#define LONG_MATCH_LEN (15 + MATCH_LEN_MIN)
-// distinguished length extension value for "long match"
-#define MATCH_LEN_EXTENSION_EXTRA (255)
+const u8 lz4_overlap_step[16] = { 16, 16, 16, 15, 16, 15, 12, 14, 16, 9, 10, 11, 12, 13, 14, 15 };
 
-// sizeof match offset in lz4 sequence
-#define MATCH_OFFSET_LEN (2)
+#ifdef LZ4_OVERLAP_FILL_SSSE3
 
-// Total speculative look-ahead on input buffer
-#define IN_LOOKAHEAD (LITS_LEN_MATCH_LEN_TOKEN_SIZE + LITS_LOOKAHEAD + LONG_LIT_LOOKAHEAD + MATCH_OFFSET_LEN + LONG_MATCH_LOOKAHEAD)
+int lz4_overlap_fill_use_ssse3 = 0;
 
-// Total speculative look-ahead on output buffer
-#define OUT_LOOKAHEAD (LITS_LOOKAHEAD + MATCH_LOOKAHEAD)
-
-
-// TODO
-#define xCONFIG_USE_LIKELY
-#define register
+__attribute__((constructor))
+static void lz4_overlap_fill_init(void) {
+  __builtin_cpu_init();
+  lz4_overlap_fill_use_ssse3 = __builtin_cpu_supports("ssse3");
+}
 
-#ifdef CONFIG_USE_LIKELY
-#define likely(x)   __builtin_expect(!!(x), 1)
-#define unlikely(x) __builtin_expect(!!(x), 0)
-#else
-#define likely(x) x
-#define unlikely(x) x
-#endif //def CONFIG_USE_LIKELY
+// lz4_overlap_fill() with pshufb - only called if the CPU has SSSE3.
+__attribute__((target("ssse3")))
+void lz4_overlap_fill_ssse3(u8* out, const u8* match, u8* out_match_limit) {
+  size_t step = lz4_overlap_step[out - match];
 
-static inline size_t token_to_lits_len(u8 token) {
-  return token >> LITS_LEN_BITS;
+  __m128i pattern = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)match),
+				     _mm_loadu_si128((const __m128i*)lz4_overlap_shuffle[out - match]));
+  do {
+    _mm_storeu_si128((__m128i*)out, pattern);
+    out += step;
+  } while(out < out_match_limit);
 }
 
-static inline size_t token_to_match_len(u8 token) {
-  return (token & MATCH_LEN_MASK) + MATCH_LEN_MIN;
-}
+#endif //def LZ4_OVERLAP_FILL_SSSE3
 
 // No limitations
+// Matches may reach back before out as far as window_start, and then on into
+//   the dict_len bytes of external dictionary.
+// Stops at the end of the first sequence that reaches target_len bytes of output.
 // @return decoded data length or -ve error val
-ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+ssize_t lz4_decode_sequences_default(u8* window_start, const u8* dict, const size_t dict_len, u8* out_void, const size_t out_len, const size_t target_len, const u8* in_void, const size_t in_len) {
   u8* out_start = (u8*)out_void;
   u8* out = (u8*)out_void;
   u8* out_limit = out + out_len;
@@ -77,7 +71,14 @@ ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const voi
   const u8* in = (const u8*)in_void;
   const u8* in_limit = in + in_len;
 
+  const int sampled = LZ4_STATS_SAMPLE();
+
   while(in < in_limit && out < out_limit) {
+    if((size_t)(out - out_start) >= target_len) {
+      // Reached the target on a sequence boundary
+      return out - out_start;
+    }
+
     //printf("                         sequence at in %lu out %lu\n", in - in_start, out - out_start);
     // Parse literals- and match length token
     u8 lits_len_match_len_token = *in++;
@@ -126,9 +127,15 @@ ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const voi
       
       //printf("                                       match-offset %lu\n", match_offset);
       
-      // Do comparison this way to avoid underflow of out_start.
-      if(out - out_start < match_offset) {
-	return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+      // Do comparison this way to avoid underflow of window_start.
+      size_t window_len = out - window_start;
+      size_t dict_back = 0;
+      if(window_len < match_offset) {
+	// Match starts in the dictionary
+	dict_back = match_offset - window_len;
+	if(dict_len < dict_back) {
+	  return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+	}
       }
 
       // Handle match length extension
@@ -151,11 +158,15 @@ ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const voi
 	return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
       }
 
-      u8* match = out - match_offset;
-      // Input can overlap output so use memmove()
-      memmove(out, match, match_len);
-      
-      out += match_len;
+      if(dict_back != 0) {
+	out = lz4_copy_dict_match(out, window_start, dict, dict_len, dict_back, match_len);
+      } else {
+	out = lz4_copy_match(out, out - match_offset, match_len);
+      }
+
+      LZ4_STATS_SEQUENCE(sampled, slow, lits_len, match_len, match_offset);
+    } else {
+      LZ4_STATS_LITS(sampled, slow, lits_len);
     }
   }
 
@@ -166,229 +177,951 @@ ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const voi
   return out - out_start;
 }
 
+// No limitations
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  return lz4_decode_sequences_default((u8*)out_void, 0, 0, (u8*)out_void, out_len, SIZE_MAX, (const u8*)in_void, in_len);
+}
+
+// decode_sequence_fast() results other than -ve error vals
+#define SEQ_FAST_OK (0)
+#define SEQ_FAST_BAIL (1)
+
+// One sequence of fast mode with speculative look-ahead - see decode_sequences_fast().
+// The caller has checked that *out_p < out_fast_limit and *in_p < in_fast_limit.
+// With window_checked 0 the caller guarantees that *out_p is at least LZ4_WINDOW_SIZE
+//   bytes past window_start, so that no 16-bit match offset can reach before it.
+// Kept separate from the loop so that the interleaved decoder can step several
+//   independent blocks one sequence at a time.
+// The sequence is recorded in the decoder statistics if sampled is set.
+// @return SEQ_FAST_OK with *out_p and *in_p after the sequence, SEQ_FAST_BAIL with
+//   them unchanged at the start of the sequence, or -ve error val
+static inline __attribute__((always_inline))
+ssize_t decode_sequence_fast(const int window_checked, const int sampled, u8* window_start, const u8* dict, const size_t dict_len,
+			     u8** out_p, u8* const out_fast_limit, u8* const out_limit,
+			     const u8** in_p, const u8* const in_fast_limit, const u8* const in_limit) {
+  register u8* restrict out = *out_p;
+  register const u8* restrict in = *in_p;
+
+  u8 lits_len_match_len_token = *in++;
+  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+  register size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+  // Speculatively read and write 16 bytes of literals assuming lit-len < 15.
+  u64 lits1 = *(const u64*)(in+0);
+  *(u64*)(out+0) = lits1;
+  u64 lits2 = *(const u64*)(in + sizeof(u64));
+  *(u64*)(out+sizeof(u64)) = lits2;
+
+  in += lits_len;
+  out += lits_len;
+
+  // Speculatively read match offset assuming lit-len < 15.
+  // It's a pity that the match offset in lz4 format does not immediately follow the
+  //   initial lengths token. If that were the case then this would not be speculative.
+  size_t match_offset = *(const u16*)in;
+  in += MATCH_OFFSET_LEN;
+
+  // We will check that this is in-range below...
+  u8* match = out - match_offset;
+
+  // If this is a long literal then most of the above speculation is incorrect and
+  // we need to read the long literals length and redo everything.
+  // By far the common case is short literals length (<15) ~97%.
+  if(unlikely(lits_len == LONG_LITS_LEN)) {
+    // Reverse input back to the start of the lit length extension
+    in -= 15/*lits_len*/ + MATCH_OFFSET_LEN;
+    const u8* orig_in = in - 1;
+    // Reverse output back to before the speculative literals
+    out -= 15/*lits_len*/;
+
+    // OK not to check input buffer overflow here cos the first lit-len extension
+    // byte is definitely within the 16-bytes allowed for literals look-ahead.
+    u8 lits_len_extension = *in++;
+    lits_len += lits_len_extension;
+
+    while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA)) {
+      if(in_fast_limit <= in) {
+	// Bail to slow mode but go back to start of current sequence first
+	in = orig_in;
+	goto bail;
+      }
+      lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+    }
+
+    // If we're too close to the buffer end then bail to slow mode.
+    // Note this is more conservative than necessary for "in".
+    if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
+	in = orig_in;
+	goto bail;
+    }
+
+    memcpy(out, in, lits_len);
+
+    in += lits_len;
+    out += lits_len;
+
+    match_offset = *(const u16*)in;
+    in += MATCH_OFFSET_LEN;
+
+    // We will check that this is in-range below...
+    match = out - match_offset;
+  }
+
+  // We are now at the match. At this stage:
+  //   in    - points to (optional) match length extension in the current
+  //           sequence, or the next sequence start.
+  //   out   - after the (optional) literals
+  //   match - the source of the match string, not yet bounds-checked
+
+  // Sanity check that the match is within the window - this is only needed in the
+  //   opening phase, before a whole window of output.
+  // Compare the offset rather than the match pointer to avoid underflow of window_start.
+  if(window_checked && unlikely((size_t)(out - window_start) < match_offset)) {
+    // The match starts in the external dictionary, if there is one. This is rare so
+    //   finish the sequence here exactly, with no speculation.
+    size_t dict_back = window_start - match;
+    if(dict_len < dict_back) {
+      return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+    }
+
+    if(match_len == LONG_MATCH_LEN) {
+      u8 match_len_extension;
+      do {
+	if(!(in < in_limit)) {
+	  return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+	}
+	match_len_extension = *in++;
+	match_len += match_len_extension;
+      } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+    }
+
+    if((size_t)(out_limit - out) < match_len) {
+      return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+    }
+
+    out = lz4_copy_dict_match(out, window_start, dict, dict_len, dict_back, match_len);
+    LZ4_STATS_SEQUENCE(sampled, fast_dict, lits_len, match_len, match_offset);
+    goto done;
+  }
+
+  // Speculatively read and write 16 bytes of match
+  u64 matches1 = *(const u64*)(match+0);
+  *(u64*)(out+0) = matches1;
+  u64 matches2 = *(const u64*)(match + sizeof(u64));
+  *(u64*)(out+sizeof(u64)) = matches2;
+
+  // Fast path ~80%
+  // Hrmm, don't like the 2nd condition
+  if(likely(match_len <= 16 && match + 8 <= out)) {
+    out += match_len;
+    LZ4_STATS_SEQUENCE(sampled, fast_short, lits_len, match_len, match_offset);
+    goto done;
+  }
+
+  // Handle match length extension.
+  // This is the minority case but somewhat common ~25%
+  if(unlikely(match_len == LONG_MATCH_LEN)) {
+    // Compute the start of the input sequence in case we need to bail to slow mode
+    const u8* orig_in =
+      in
+      - MATCH_OFFSET_LEN
+      - (lits_len < LONG_LITS_LEN ? 0 : (lits_len - LONG_LITS_LEN)/LITS_LEN_EXTENSION_EXTRA + 1)/*lits len extension*/
+      - lits_len
+      - LITS_LEN_MATCH_LEN_TOKEN_SIZE;
+
+    // Safe cos include in input lookahead
+    size_t match_len_extension = *in++;
+    match_len += match_len_extension;
+    while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA)) {
+      if(in_fast_limit <= in) {
+	// Bail to slow mode but go back to start of current sequence first
+	in = orig_in;
+	out -= lits_len;
+	goto bail;
+      }
+      match_len_extension = *in++;
+      match_len += match_len_extension;
+    }
+    // If we're too close to the buffer end then bail to slow mode.
+    if(unlikely(out_fast_limit <= out + match_len)) {
+	in = orig_in;
+	out -= lits_len;
+	goto bail;
+    }
+  }
+
+  // Here we either have a long'ish match - > 16 bytes, or we have an overlap match of any length
+
+  // Is the match an overlap?
+  // By far the common case is no overlap ~97%.
+  register u8* match_limit = match + match_len;
+  if(likely(match_limit <= out || match + sizeof(u64) <= out)) {
+    // No problematic overlap, long match > 16 bytes
+    match += 16;
+    out += 16;
+    while(likely(match < match_limit)) {
+      u64 matches1 = *(const u64*)(match+0);
+      *(u64*)(out+0) = matches1;
+      u64 matches2 = *(const u64*)(match + sizeof(u64));
+      *(u64*)(out+sizeof(u64)) = matches2;
+
+      match += 16;
+      out += 16;
+    }
+
+    // Correct speculative over-run
+    out -= (match - match_limit);
+
+    LZ4_STATS_SEQUENCE(sampled, fast_long, lits_len, match_len, match_offset);
+
+  } else {
+    // Overlap < 8 bytes - can't copy u64 (8 bytes) at a time.
+    // Dominated by offset == 1 (byte fill) then to a lesser extent by
+    //   offset == 4 (4-byte fill) and offset == 2 (2-byte fill).
+    static const u8 is_aligned_fill[] = { 0, 1, 1, 0, 1, 0, 0, 0 };
+    size_t offset = out - match;
+    if(likely(is_aligned_fill[offset])) {
+      u64 match_pattern;
+      if(likely(offset == 1)) {
+	u8 u8_pattern = *match;
+	// TODO - is multiply faster than shifting etc? Could also do table look-up;
+	match_pattern = ((u64)u8_pattern) * 0x0101010101010101UL;
+      } else if(likely(offset == 4)) {
+	u32 u32_pattern = *(u32*)match;
+	match_pattern = (u64)u32_pattern | ((u64)u32_pattern << 32);
+      } else {
+	// offset == 2
+	u16 u16_pattern = *(u16*)match;
+	// TODO - is multiply faster than shifting etc?
+	match_pattern = ((u64)u16_pattern) * 0x0001000100010001UL;
+      }
+
+      // Fill with the match pattern.
+      u8* out_match_limit = out + match_len;
+      do {
+	*(u64*)(out+0) = match_pattern;
+	*(u64*)(out+sizeof(u64)) = match_pattern;
+	out += 16;
+      } while(likely(out < out_match_limit));
+
+      // Fix speculative overrun
+      out = out_match_limit;
+
+    } else {
+      // Offset 3, 5, 6 or 7 - expand the pattern with the shuffle tables.
+      u8* out_match_limit = out + match_len;
+      lz4_overlap_fill(out, match, out_match_limit);
+      out = out_match_limit;
+    }
+
+    LZ4_STATS_OVERLAP_FILL(sampled, match_offset);
+    LZ4_STATS_SEQUENCE(sampled, fast_overlap, lits_len, match_len, match_offset);
+  }
+
+ done:
+  *out_p = out;
+  *in_p = in;
+  return SEQ_FAST_OK;
+
+  // Back at the start of the sequence - leave it to the slow decoder.
+ bail:
+  LZ4_STATS_BAIL();
+  *out_p = out;
+  *in_p = in;
+  return SEQ_FAST_BAIL;
+}
+
+// Look-ahead for lz4_decode_block_fast_prefetch() - a scout parses sequences
+//   PREFETCH_DISTANCE ahead of the fast loop and prefetches the sources of matches
+//   that are far behind the output.
+// The scout and the decoder are independent dependency chains, so they overlap in
+//   the CPU as long as they are interleaved sequence by sequence.
+
+// Number of sequences that the scout runs ahead of the decoder.
+#define PREFETCH_DISTANCE (8)
+// Matches at least this far back are not expected to be in L1 cache.
+#define PREFETCH_MIN_OFFSET (16*1024)
+// One in this many far matches has its first load timed by the decoder - alternately
+//   prefetched and not. Power of 2.
+#define PREFETCH_SAMPLE_RATE (16)
+// Scouted sequences whose probes have not been taken by the decoder yet. Power of 2,
+//   more than PREFETCH_DISTANCE.
+#define PREFETCH_PROBES_LEN (16)
+
+// A sampled far match, for the decoder to time its first load.
+typedef struct prefetch_probe {
+  // Match source, or 0 if the sequence is not sampled
+  const u8* match;
+  int prefetched;
+} prefetch_probe;
+
+// Scout state - locals of the decoder loop rather than in the caller's stats, where they
+//   would have to be reloaded after every store of output.
+// The counts carry on from the caller's stats so that sampling carries on across blocks.
+typedef struct prefetch_scout {
+  const u8* in;
+  u8* out;
+  // Sequences scouted in this call
+  u64 n_scouted;
+  // Far matches scouted, from the caller's stats on - picks the samples
+  u64 n_far;
+  lz4_prefetch_stats stats;
+  prefetch_probe probes[PREFETCH_PROBES_LEN];
+} prefetch_scout;
+
+// Parse the next sequence of the scout, and prefetch its match - or sample it.
+// Reads stay within the input look-ahead of in_fast_limit, like the fast loop.
+// Nothing is validated - a corrupt sequence only costs a useless prefetch, since the
+//   decoder checks everything itself when it gets there.
+// @return 1 with the scout advanced past the sequence, or 0 if it is too near the end
+//   of the input, which is left to the decoder
+static inline __attribute__((always_inline))
+int scout_sequence(prefetch_scout* scout, const u8* const in_fast_limit) {
+  const u8* in = scout->in;
+
+  if(unlikely(in_fast_limit <= in)) {
+    return 0;
+  }
+
+  u8 lits_len_match_len_token = *in++;
+  size_t lits_len = token_to_lits_len(lits_len_match_len_token);
+  size_t match_len = token_to_match_len(lits_len_match_len_token);
+
+  // Length extensions are parsed branch-free for the usual single extension byte, as
+  //   whether there is one is not predictable. These reads are all within the input
+  //   look-ahead of a sequence that starts before in_fast_limit.
+  size_t is_long_lits = lits_len == LONG_LITS_LEN;
+  u8 lits_len_extension = *in;
+  lits_len += is_long_lits ? lits_len_extension : 0;
+  in += is_long_lits;
+
+  if(unlikely(is_long_lits && lits_len_extension == LITS_LEN_EXTENSION_EXTRA)) {
+    do {
+      if(in_fast_limit <= in) {
+	return 0;
+      }
+      lits_len_extension = *in++;
+      lits_len += lits_len_extension;
+    } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+  }
+
+  // The long literals length can take in past in_fast_limit.
+  if(unlikely(in_fast_limit <= in || (size_t)(in_fast_limit - in) <= lits_len)) {
+    return 0;
+  }
+  in += lits_len;
+
+  size_t match_offset = *(const u16*)in;
+  in += MATCH_OFFSET_LEN;
+
+  size_t is_long_match = match_len == LONG_MATCH_LEN;
+  u8 match_len_extension = *in;
+  match_len += is_long_match ? match_len_extension : 0;
+  in += is_long_match;
+
+  if(unlikely(is_long_match && match_len_extension == MATCH_LEN_EXTENSION_EXTRA)) {
+    do {
+      if(in_fast_limit <= in) {
+	return 0;
+      }
+      match_len_extension = *in++;
+      match_len += match_len_extension;
+    } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+  }
+
+  uintptr_t out = (uintptr_t)scout->out + lits_len;
+
+  // Whether a match is far is not predictable, so this is branch-free - near matches
+  //   and controls prefetch the output position instead, which is in cache anyway.
+  // Prefetch never faults, so the unchecked match address is harmless.
+  size_t is_far = match_offset >= PREFETCH_MIN_OFFSET;
+  size_t is_sample = is_far && (scout->n_far & (PREFETCH_SAMPLE_RATE - 1)) == 0;
+  size_t is_control = is_sample && (scout->n_far & PREFETCH_SAMPLE_RATE) != 0;
+  __builtin_prefetch((const void*)(out - (is_far && !is_control ? match_offset : 0)));
+  scout->stats.far_prefetches += is_far && !is_control;
+  scout->n_far += is_far;
+
+  prefetch_probe* probe = &scout->probes[scout->n_scouted & (PREFETCH_PROBES_LEN - 1)];
+  probe->match = is_sample ? (const u8*)(out - match_offset) : 0;
+  probe->prefetched = !is_control;
+
+  scout->n_scouted++;
+  scout->stats.sequences_scouted++;
+  scout->in = in;
+  scout->out = (u8*)(out + match_len);
+  return 1;
+}
+
+// Time the first load of the match source of the sequence at out, if the scout sampled
+//   it - before the decoder loads it. The match is only loaded if it lies in the output
+//   already decoded, so a corrupt sequence can not fault here.
+static inline __attribute__((always_inline))
+void probe_sequence(prefetch_scout* scout, const u64 n_decoded, const u8* const window_start, const u8* const out) {
+  if(n_decoded >= scout->n_scouted) {
+    // Past the end of the scout
+    return;
+  }
+
+  const prefetch_probe* probe = &scout->probes[n_decoded & (PREFETCH_PROBES_LEN - 1)];
+  if(likely(probe->match == 0) || probe->match < window_start || out <= probe->match) {
+    return;
+  }
+
+  _mm_lfence();
+  u64 t0 = __rdtsc();
+  _mm_lfence();
+  *(volatile const u8*)probe->match;
+  _mm_lfence();
+  u64 cycles = __rdtsc() - t0;
+
+  if(probe->prefetched) {
+    scout->stats.prefetched_samples++;
+    scout->stats.prefetched_cycles += cycles;
+  } else {
+    scout->stats.control_samples++;
+    scout->stats.control_cycles += cycles;
+  }
+}
+
+// Fast mode with speculative look-ahead.
+// Decodes whole sequences while out < out_stop and in < in_fast_limit, and returns
+//   at the start of the first sequence that would need more look-ahead than
+//   out_fast_limit or in_fast_limit allow, with *out_p and *in_p updated.
+// out_stop <= out_fast_limit lets the caller stop early at a sequence boundary - a
+//   sequence that crosses out_stop is still decoded in full.
+// It never assumes that the input ends at the end of the block - the last sequence
+//   is always left to the caller.
 // Limitations:
 // Assumes non-aligned memory accesses work with primitive C integer types - undefined officially
 // Assumes little-endian
+// Matches may reach back as far as window_start, and then on into the dict_len
+//   bytes of external dictionary.
+// With stats (not 0), a scout runs ahead of the decoder prefetching far matches, and
+//   counts are added to stats.
+// @return 0 or -ve error val
+static inline __attribute__((always_inline))
+ssize_t decode_sequences_fast(lz4_prefetch_stats* stats, u8* window_start, const u8* dict, const size_t dict_len,
+			      u8** out_p, u8* const out_stop, u8* const out_fast_limit, u8* const out_limit,
+			      const u8** in_p, const u8* const in_fast_limit, const u8* const in_limit) {
+  u8* out = *out_p;
+  const u8* in = *in_p;
+
+  ssize_t rc = SEQ_FAST_OK;
+
+  prefetch_scout scout;
+  u64 n_decoded = 0;
+
+  const int sampled = LZ4_STATS_SAMPLE();
+
+  if(stats) {
+    scout.in = in;
+    scout.out = out;
+    scout.n_scouted = 0;
+    scout.n_far = stats->far_prefetches + stats->control_samples;
+    scout.stats = *stats;
+    while(scout.n_scouted < PREFETCH_DISTANCE && scout_sequence(&scout, in_fast_limit)) {}
+  }
+
+  // Opening phase - matches are checked against the window until there is a whole
+  //   window of output before out.
+  u8* const out_window_stop = out_stop - window_start > (ptrdiff_t)LZ4_WINDOW_SIZE ? window_start + LZ4_WINDOW_SIZE : out_stop;
+
+  // Fast mode with speculative look-ahead
+  // Note we could go further and speculatively read some input before doing these
+  //   bounds checks, but for now hope that hardware speculative execution is
+  //   sufficient.
+  while(likely(out < out_window_stop && in < in_fast_limit)) {
+    if(stats) {
+      // One more to keep the scout ahead - it only stops near the end of the input.
+      scout_sequence(&scout, in_fast_limit);
+      probe_sequence(&scout, n_decoded++, window_start, out);
+    }
+
+    rc = decode_sequence_fast(1, sampled, window_start, dict, dict_len, &out, out_fast_limit, out_limit, &in, in_fast_limit, in_limit);
+
+    if(unlikely(rc != SEQ_FAST_OK)) {
+      goto stop;
+    }
+  }
+
+  // Steady state - match offsets are 16 bits so matches can no longer reach before
+  //   window_start, and need no checks.
+  while(likely(out < out_stop && in < in_fast_limit)) {
+    if(stats) {
+      // One more to keep the scout ahead - it only stops near the end of the input.
+      scout_sequence(&scout, in_fast_limit);
+      probe_sequence(&scout, n_decoded++, window_start, out);
+    }
+
+    rc = decode_sequence_fast(0, sampled, window_start, dict, dict_len, &out, out_fast_limit, out_limit, &in, in_fast_limit, in_limit);
+
+    if(unlikely(rc != SEQ_FAST_OK)) {
+      goto stop;
+    }
+  }
+
+ stop:
+  if(stats) {
+    *stats = scout.stats;
+  }
+
+  if(rc < 0) {
+    // Error code
+    return rc;
+  }
+
+  // Back at a sequence boundary - leave the rest to the caller.
+  *out_p = out;
+  *in_p = in;
+  return 0;
+}
+
+// Matches may reach back before out_void as far as window_start, and then on into
+//   the dict_len bytes of external dictionary.
+// Stops at the end of the first sequence that reaches target_len bytes of output.
 // @return decoded data length or -ve error val
-ssize_t lz4_decode_block_fast(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
-  register u8* restrict out_start = (u8*)out_void;
-  register u8* restrict out = (u8*)out_void;
+static inline __attribute__((always_inline))
+ssize_t decode_block_fast_window(lz4_prefetch_stats* stats, u8* window_start, const u8* dict, const size_t dict_len, void* out_void, const size_t out_len, const size_t target_len, const void* in_void, const size_t in_len) {
+  u8* out_start = (u8*)out_void;
+  u8* out = (u8*)out_void;
   u8* const out_limit = out + out_len;
   
-  register const u8* restrict in = (const u8*)in_void;
+  const u8* in = (const u8*)in_void;
   const u8* const in_limit = in + in_len;
 
   // Output buffer limit for speculative lookahead
-  register u8* const out_fast_limit = out_limit - OUT_LOOKAHEAD;
+  u8* const out_fast_limit = out_limit - OUT_LOOKAHEAD;
+
+  // Stop at the target if that comes first
+  u8* const out_stop = (out_len > OUT_LOOKAHEAD && target_len < out_len - OUT_LOOKAHEAD) ? out_start + target_len : out_fast_limit;
 
   // Input buffer limit for speculative lookahead
-  register const u8* const in_fast_limit = in_limit - IN_LOOKAHEAD;
+  const u8* const in_fast_limit = in_limit - IN_LOOKAHEAD;
 
-  // Fast mode with speculative look-ahead
-  // Note we could go further and speculatively read some input before doing these
-  //   bounds checks, but for now hope that hardware speculative execution is
-  //   sufficient.
-  while(likely(out < out_fast_limit && in < in_fast_limit)) {
+  ssize_t fast_rc = decode_sequences_fast(stats, window_start, dict, dict_len, &out, out_stop, out_fast_limit, out_limit, &in, in_fast_limit, in_limit);
+
+  if(fast_rc < 0) {
+    // Error code
+    return fast_rc;
+  }
+
+  if((size_t)(out - out_start) >= target_len) {
+    return out - out_start;
+  }
+
+  // Slow mode with no speculative look-ahead for end of buffers where speculative
+  //   look-ahead would overrun input or output buffers.
+  size_t out_so_far = out - out_start;
+  size_t in_so_far = in - (const u8*)in_void;
+    
+  // Matches can still reach back into the output decoded by the fast loop.
+  ssize_t slow_rc = lz4_decode_sequences_default(window_start, dict, dict_len, out, out_len - out_so_far, target_len - out_so_far, in, in_len - in_so_far);
+    
+  if(slow_rc < 0) {
+    // Error code
+    return slow_rc;
+  }
+    
+  return out_so_far + slow_rc;
+}
+
+// @return 0 or -ve error val
+ssize_t lz4_decode_sequences_fast(u8* window_start, u8** out_p, u8* out_limit, const u8** in_p, const u8* in_limit) {
+  // Fast limits must not underflow the buffer starts
+  if((size_t)(out_limit - *out_p) <= OUT_LOOKAHEAD || (size_t)(in_limit - *in_p) <= IN_LOOKAHEAD) {
+    return 0;
+  }
+
+  return decode_sequences_fast(0, window_start, 0, 0, out_p, out_limit - OUT_LOOKAHEAD, out_limit - OUT_LOOKAHEAD, out_limit, in_p, in_limit - IN_LOOKAHEAD, in_limit);
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_fast(void* out_void, const size_t out_len, const void* in_void, const size_t in_len) {
+  return decode_block_fast_window(0, (u8*)out_void, 0, 0, out_void, out_len, SIZE_MAX, in_void, in_len);
+}
+
+ssize_t lz4_decode_block_fast_prefetch(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, lz4_prefetch_stats* stats) {
+  // The scout runs with or without the caller's stats
+  lz4_prefetch_stats block_stats = { 0 };
+
+  return decode_block_fast_window(stats ? stats : &block_stats, (u8*)out_void, 0, 0, out_void, out_len, SIZE_MAX, in_void, in_len);
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_prefix(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len) {
+  // Matches can never reach back further than the lz4 window.
+  size_t window_len = prefix_len < LZ4_WINDOW_SIZE ? prefix_len : LZ4_WINDOW_SIZE;
+
+  return decode_block_fast_window(0, (u8*)out_void - window_len, 0, 0, out_void, out_len, SIZE_MAX, in_void, in_len);
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_dict(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const void* dict_void, const size_t dict_len) {
+  // Only the tail of the dictionary that fits in the lz4 window can be referenced.
+  size_t window_dict_len = dict_len < LZ4_WINDOW_SIZE ? dict_len : LZ4_WINDOW_SIZE;
+  const u8* window_dict = (const u8*)dict_void + (dict_len - window_dict_len);
+
+  return decode_block_fast_window(0, (u8*)out_void, window_dict, window_dict_len, out_void, out_len, SIZE_MAX, in_void, in_len);
+}
+
+// Matches reach back into the prefix, and then on into the tail of the dictionary
+//   that is still within the lz4 window.
+static inline void prefix_dict_window(u8* out, const size_t prefix_len, const u8* dict, const size_t dict_len, u8** window_start_p, const u8** window_dict_p, size_t* window_dict_len_p) {
+  size_t window_len = prefix_len < LZ4_WINDOW_SIZE ? prefix_len : LZ4_WINDOW_SIZE;
+  size_t dict_room = LZ4_WINDOW_SIZE - window_len;
+  size_t window_dict_len = dict_len < dict_room ? dict_len : dict_room;
+
+  *window_start_p = out - window_len;
+  *window_dict_p = dict + (dict_len - window_dict_len);
+  *window_dict_len_p = window_dict_len;
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_prefix_dict(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, const void* dict_void, const size_t dict_len) {
+  u8* window_start;
+  const u8* window_dict;
+  size_t window_dict_len;
+  prefix_dict_window((u8*)out_void, prefix_len, (const u8*)dict_void, dict_len, &window_start, &window_dict, &window_dict_len);
+
+  return decode_block_fast_window(0, window_start, window_dict, window_dict_len, out_void, out_len, SIZE_MAX, in_void, in_len);
+}
+
+// Walks the sequences adding up their lengths - nothing is copied, and the match offsets
+//   are not checked since they depend on the history of the block.
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_len(const void* in_void, const size_t in_len) {
+  const u8* in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+  size_t out_len = 0;
+
+  while(in < in_limit) {
     u8 lits_len_match_len_token = *in++;
     size_t lits_len = token_to_lits_len(lits_len_match_len_token);
-    register size_t match_len = token_to_match_len(lits_len_match_len_token);
+    size_t match_len = token_to_match_len(lits_len_match_len_token);
 
-    // Speculatively read and write 16 bytes of literals assuming lit-len < 15.
-    u64 lits1 = *(const u64*)(in+0);
-    *(u64*)(out+0) = lits1;
-    u64 lits2 = *(const u64*)(in + sizeof(u64));
-    *(u64*)(out+sizeof(u64)) = lits2;
+    if(lits_len == LONG_LITS_LEN) {
+      u8 lits_len_extension;
+      do {
+	if(!(in < in_limit)) {
+	  return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+	}
+	lits_len_extension = *in++;
+	lits_len += lits_len_extension;
+      } while(lits_len_extension == LITS_LEN_EXTENSION_EXTRA);
+    }
 
+    if((size_t)(in_limit - in) < lits_len) {
+      return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+    }
     in += lits_len;
-    out += lits_len;
+    out_len += lits_len;
+
+    // The last sequence has no match
+    if(in == in_limit) {
+      break;
+    }
 
-    // Speculatively read match offset assuming lit-len < 15.
-    // It's a pity that the match offset in lz4 format does not immediately follow the
-    //   initial lengths token. If that were the case then this would not be speculative.
-    size_t match_offset = *(const u16*)in;
+    if((size_t)(in_limit - in) < MATCH_OFFSET_LEN) {
+      return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
+    }
     in += MATCH_OFFSET_LEN;
-    
-    // We will check that this is in-range below...
-    u8* match = out - match_offset;
-
-    // If this is a long literal then most of the above speculation is incorrect and
-    // we need to read the long literals length and redo everything.
-    // By far the common case is short literals length (<15) ~97%.
-    if(unlikely(lits_len == LONG_LITS_LEN)) {
-      // Reverse input back to the start of the lit length extension
-      in -= 15/*lits_len*/ + MATCH_OFFSET_LEN;
-      const u8* orig_in = in - 1;
-      // Reverse output back to before the speculative literals
-      out -= 15/*lits_len*/;
-
-      // OK not to check input buffer overflow here cos the first lit-len extension
-      // byte is definitely within the 16-bytes allowed for literals look-ahead.
-      u8 lits_len_extension = *in++;
-      lits_len += lits_len_extension;
 
-      while(unlikely(lits_len_extension == LITS_LEN_EXTENSION_EXTRA)) {
-	if(in_fast_limit <= in) {
-	  // Bail to slow mode but go back to start of current sequence first
-	  in = orig_in;
-	  goto slow;
+    if(match_len == LONG_MATCH_LEN) {
+      u8 match_len_extension;
+      do {
+	if(!(in < in_limit)) {
+	  return -LZ4_DECODE_ERR_INPUT_OVERFLOW;
 	}
-	lits_len_extension = *in++;
-	lits_len += lits_len_extension;
+	match_len_extension = *in++;
+	match_len += match_len_extension;
+      } while(match_len_extension == MATCH_LEN_EXTENSION_EXTRA);
+    }
+
+    out_len += match_len;
+  }
+
+  return out_len;
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_partial(void* out_void, const size_t target_len, const size_t out_capacity, const void* in_void, const size_t in_len) {
+  return decode_block_fast_window(0, (u8*)out_void, 0, 0, out_void, out_capacity, target_len, in_void, in_len);
+}
+
+// One block of lz4_decode_blocks_interleaved().
+typedef struct interleave_lane {
+  // Index of the block in the caller's arrays
+  size_t block;
+  // Reason the lane left fast mode - SEQ_FAST_OK when it ran into the fast limits
+  ssize_t fast_rc;
+
+  u8* out_start;
+  u8* out;
+  u8* out_fast_limit;
+  u8* out_limit;
+
+  const u8* in_start;
+  const u8* in;
+  const u8* in_fast_limit;
+  const u8* in_limit;
+} interleave_lane;
+
+// Advance n_lanes blocks in fast mode one sequence each in turn, so that the dependency
+//   chains of the blocks overlap in the CPU, until one of them can not continue.
+// Always inlined with a constant n_lanes so that the lane loop is unrolled.
+// @return index of the lane that stopped
+static inline __attribute__((always_inline))
+size_t decode_lanes_lockstep(interleave_lane* lanes, const size_t n_lanes) {
+  const int sampled = LZ4_STATS_SAMPLE();
+
+  for(;;) {
+    for(size_t k = 0; k < n_lanes; k++) {
+      interleave_lane* lane = &lanes[k];
+
+      if(unlikely(!(lane->out < lane->out_fast_limit && lane->in < lane->in_fast_limit))) {
+	lane->fast_rc = SEQ_FAST_OK;
+	return k;
       }
 
-      // If we're too close to the buffer end then bail to slow mode.
-      // Note this is more conservative than necessary for "in".
-      if(unlikely(in_fast_limit <= in + lits_len || out_fast_limit <= out + lits_len)) {
-	  in = orig_in;
-	  goto slow;
+      ssize_t rc = decode_sequence_fast(1, sampled, lane->out_start, 0, 0, &lane->out, lane->out_fast_limit, lane->out_limit, &lane->in, lane->in_fast_limit, lane->in_limit);
+
+      if(unlikely(rc != SEQ_FAST_OK)) {
+	lane->fast_rc = rc;
+	return k;
       }
+    }
+  }
+}
 
-      memcpy(out, in, lits_len);
+// Finish a lane that has left fast mode with the slow decoder.
+// @return decoded data length or -ve error val
+static ssize_t finish_lane(const interleave_lane* lane) {
+  if(lane->fast_rc < 0) {
+    // Error code
+    return lane->fast_rc;
+  }
 
-      in += lits_len;
-      out += lits_len;
+  size_t out_so_far = lane->out - lane->out_start;
+  size_t in_so_far = lane->in - lane->in_start;
 
-      match_offset = *(const u16*)in;
-      in += MATCH_OFFSET_LEN;
-    
-      // We will check that this is in-range below...
-      match = out - match_offset;
+  ssize_t slow_rc = lz4_decode_sequences_default(lane->out_start, 0, 0, lane->out, (lane->out_limit - lane->out_start) - out_so_far, SIZE_MAX, lane->in, (lane->in_limit - lane->in_start) - in_so_far);
+
+  if(slow_rc < 0) {
+    // Error code
+    return slow_rc;
+  }
+
+  return out_so_far + slow_rc;
+}
+
+// Set up a lane for a block.
+// Blocks too short for any look-ahead go straight to the slow decoder.
+// @return 1 if the lane is ready for fast mode, else 0 with results[block] set
+static int init_lane(interleave_lane* lane, const size_t block, void* out_void, const size_t out_len, const void* in_void, const size_t in_len, ssize_t results[]) {
+  lane->block = block;
+  lane->fast_rc = SEQ_FAST_OK;
+
+  lane->out_start = lane->out = (u8*)out_void;
+  lane->out_limit = lane->out_start + out_len;
+
+  lane->in_start = lane->in = (const u8*)in_void;
+  lane->in_limit = lane->in_start + in_len;
+
+  if(out_len <= OUT_LOOKAHEAD || in_len <= IN_LOOKAHEAD) {
+    results[block] = finish_lane(lane);
+    return 0;
+  }
+
+  lane->out_fast_limit = lane->out_limit - OUT_LOOKAHEAD;
+  lane->in_fast_limit = lane->in_limit - IN_LOOKAHEAD;
+  return 1;
+}
+
+// Decode a group of up to LZ4_INTERLEAVE_MAX lanes in lockstep.
+// Lanes drop out of lockstep one at a time as they reach the ends of their blocks.
+static void decode_lanes(interleave_lane* lanes, size_t n_lanes, ssize_t results[]) {
+  while(n_lanes > 0) {
+    size_t k;
+
+    switch(n_lanes) {
+    case 4: k = decode_lanes_lockstep(lanes, 4); break;
+    case 3: k = decode_lanes_lockstep(lanes, 3); break;
+    case 2: k = decode_lanes_lockstep(lanes, 2); break;
+    default: k = decode_lanes_lockstep(lanes, 1); break;
     }
 
-    // We are now at the match. At this stage:
-    //   in    - points to (optional) match length extension in the current
-    //           sequence, or the next sequence start.
-    //   out   - after the (optional) literals
-    //   match - the source of the match string, not yet bounds-checked
+    results[lanes[k].block] = finish_lane(&lanes[k]);
 
-    // Sanity check that the match is within the buffer - this can be avoided once we're
-    //   more than 64KiB into the block but is it worth it?
-    // TODO - this can underflow out_start :(
-    if(unlikely(match < out_start)) {
-      return -LZ4_DECODE_ERR_MATCH_OFFSET_TOO_LARGE;
+    lanes[k] = lanes[--n_lanes];
+  }
+}
+
+// @return 0 or the first -ve error val in results
+static ssize_t first_error(const size_t n_blocks, const ssize_t results[]) {
+  for(size_t block = 0; block < n_blocks; block++) {
+    if(results[block] < 0) {
+      return results[block];
     }
+  }
+  return 0;
+}
 
-    // Speculatively read and write 16 bytes of match
-    u64 matches1 = *(const u64*)(match+0);
-    *(u64*)(out+0) = matches1;
-    u64 matches2 = *(const u64*)(match + sizeof(u64));
-    *(u64*)(out+sizeof(u64)) = matches2;
-
-    // Fast path ~80%
-    // Hrmm, don't like the 2nd condition
-    if(likely(match_len <= 16 && match + 8 <= out)) {
-      out += match_len;
-      continue;
+// @return 0 or the first -ve error val in results
+ssize_t lz4_decode_blocks_interleaved(const size_t n_blocks, void* const outs[], const size_t out_lens[], const void* const ins[], const size_t in_lens[], ssize_t results[]) {
+  for(size_t group = 0; group < n_blocks; group += LZ4_INTERLEAVE_MAX) {
+    size_t group_end = n_blocks - group < LZ4_INTERLEAVE_MAX ? n_blocks : group + LZ4_INTERLEAVE_MAX;
+
+    interleave_lane lanes[LZ4_INTERLEAVE_MAX];
+    size_t n_lanes = 0;
+
+    for(size_t block = group; block < group_end; block++) {
+      n_lanes += init_lane(&lanes[n_lanes], block, outs[block], out_lens[block], ins[block], in_lens[block], results);
     }
 
-    // Handle match length extension.
-    // This is the minority case but somewhat common ~25%
-    if(unlikely(match_len == LONG_MATCH_LEN)) {
-      // Compute the start of the input sequence in case we need to bail to slow mode
-      const u8* orig_in =
-	in
-	- MATCH_OFFSET_LEN
-	- ((lits_len + 256 - 15)/256)/*lits len extension*/
-	- lits_len
-	- LITS_LEN_MATCH_LEN_TOKEN_SIZE;
-      
-      // Safe cos include in input lookahead
-      size_t match_len_extension = *in++;
-      match_len += match_len_extension;
-      while(unlikely(match_len_extension == MATCH_LEN_EXTENSION_EXTRA)) {
-	if(in_fast_limit <= in) {
-	  // Bail to slow mode but go back to start of current sequence first
-	  in = orig_in;
-	  out -= lits_len;
-	  goto slow;
-	}
-	match_len_extension = *in++;
-	match_len += match_len_extension;
-      }
-      // If we're too close to the buffer end then bail to slow mode.
-      if(unlikely(out_fast_limit <= out + match_len)) {
-	  in = orig_in;
-	  out -= lits_len;
-	  goto slow;
+    decode_lanes(lanes, n_lanes, results);
+  }
+
+  return first_error(n_blocks, results);
+}
+
+// Blocks of lz4_decode_blocks_batch() are prefetched this many blocks ahead of decode.
+#define BATCH_PREFETCH_BLOCKS (LZ4_INTERLEAVE_MAX)
+
+// Start loading the head of a block's input, and its first output line for write.
+// Small blocks of a batch are typically scattered across the heap and cold in cache, and
+//   the hardware prefetchers only pick up each one after its first misses.
+static inline void prefetch_block(const lz4_block_desc* desc) {
+  __builtin_prefetch(desc->in, 0, 3);
+  __builtin_prefetch((const u8*)desc->in + 64, 0, 3);
+  __builtin_prefetch(desc->out, 1, 3);
+}
+
+// @return 0 or the first -ve error val in results
+ssize_t lz4_decode_blocks_batch(const lz4_block_desc* descs, const size_t n_blocks, size_t n_interleave, ssize_t results[]) {
+  if(n_interleave < 1) {
+    n_interleave = 1;
+  } else if(n_interleave > LZ4_INTERLEAVE_MAX) {
+    n_interleave = LZ4_INTERLEAVE_MAX;
+  }
+
+  for(size_t block = 0; block < n_blocks && block < BATCH_PREFETCH_BLOCKS; block++) {
+    prefetch_block(&descs[block]);
+  }
+
+  if(n_interleave == 1) {
+    // One block at a time - lz4_decode_block_fast() without the call per block.
+    for(size_t block = 0; block < n_blocks; block++) {
+      if(block + BATCH_PREFETCH_BLOCKS < n_blocks) {
+	prefetch_block(&descs[block + BATCH_PREFETCH_BLOCKS]);
       }
+
+      const lz4_block_desc* desc = &descs[block];
+      results[block] = decode_block_fast_window(0, (u8*)desc->out, 0, 0, desc->out, desc->out_len, SIZE_MAX, desc->in, desc->in_len);
     }
 
-    // Here we either have a long'ish match - > 16 bytes, or we have an overlap match of any length
+    return first_error(n_blocks, results);
+  }
 
-    // Is the match an overlap?
-    // By far the common case is no overlap ~97%.
-    register u8* match_limit = match + match_len;
-    if(likely(match_limit <= out || match + sizeof(u64) <= out)) {
-      // No problematic overlap, long match > 16 bytes
-      match += 16;
-      out += 16;
-      while(likely(match < match_limit)) {
-	u64 matches1 = *(const u64*)(match+0);
-	*(u64*)(out+0) = matches1;
-	u64 matches2 = *(const u64*)(match + sizeof(u64));
-	*(u64*)(out+sizeof(u64)) = matches2;
+  for(size_t group = 0; group < n_blocks; group += n_interleave) {
+    size_t group_end = n_blocks - group < n_interleave ? n_blocks : group + n_interleave;
 
-	match += 16;
-	out += 16;
+    for(size_t block = group + BATCH_PREFETCH_BLOCKS; block < group_end + BATCH_PREFETCH_BLOCKS && block < n_blocks; block++) {
+      prefetch_block(&descs[block]);
+    }
+
+    interleave_lane lanes[LZ4_INTERLEAVE_MAX];
+    size_t n_lanes = 0;
+
+    for(size_t block = group; block < group_end; block++) {
+      const lz4_block_desc* desc = &descs[block];
+      n_lanes += init_lane(&lanes[n_lanes], block, desc->out, desc->out_len, desc->in, desc->in_len, results);
+    }
+
+    decode_lanes(lanes, n_lanes, results);
+  }
+
+  return first_error(n_blocks, results);
+}
+
+// Output is hashed in chunks of about this size as it is decoded, so that each chunk
+//   is hashed while it is still in L1/L2 cache.
+#define HASH_CHUNK_LEN (16*1024)
+
+// As decode_block_fast_window() for a whole block, also feeding the output to state.
+// @return decoded data length or -ve error val
+static ssize_t decode_block_hash_window(u8* window_start, const u8* dict, const size_t dict_len, void* out_void, const size_t out_len, const void* in_void, const size_t in_len, xxh32_state* state) {
+  u8* out_start = (u8*)out_void;
+  u8* out = (u8*)out_void;
+  u8* const out_limit = out + out_len;
+
+  const u8* in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+
+  if(out_len > OUT_LOOKAHEAD && in_len > IN_LOOKAHEAD) {
+    u8* const out_fast_limit = out_limit - OUT_LOOKAHEAD;
+    const u8* const in_fast_limit = in_limit - IN_LOOKAHEAD;
+
+    for(;;) {
+      u8* out_chunk_start = out;
+      u8* out_stop = (size_t)(out_fast_limit - out) > HASH_CHUNK_LEN ? out + HASH_CHUNK_LEN : out_fast_limit;
+
+      ssize_t fast_rc = decode_sequences_fast(0, window_start, dict, dict_len, &out, out_stop, out_fast_limit, out_limit, &in, in_fast_limit, in_limit);
+
+      if(fast_rc < 0) {
+	// Error code
+	return fast_rc;
       }
-      
-      // Correct speculative over-run
-      out -= (match - match_limit);
-      
-    } else {
-      // Overlap < 8 bytes - can't copy u64 (8 bytes) at a time.
-      // Dominated by offset == 1 (byte fill) then to a lesser extent by
-      //   offset == 4 (4-byte fill) and offset == 2 (2-byte fill).
-      static const u8 is_aligned_fill[] = { 0, 1, 1, 0, 1, 0, 0, 0 };
-      size_t offset = out - match;
-      if(likely(is_aligned_fill[offset])) {
-	u64 match_pattern;
-	if(likely(offset == 1)) {
-	  u8 u8_pattern = *match;
-	  // TODO - is multiply faster than shifting etc? Could also do table look-up;
-	  match_pattern = ((u64)u8_pattern) * 0x0101010101010101UL;
-	} else if(likely(offset == 4)) {
-	  u32 u32_pattern = *(u32*)match;
-	  match_pattern = (u64)u32_pattern | ((u64)u32_pattern << 32);
-	} else {
-	  // offset == 2
-	  u16 u16_pattern = *(u16*)match;
-	  // TODO - is multiply faster than shifting etc?
-	  match_pattern = ((u64)u16_pattern) * 0x0001000100010001UL;
-	}
 
-	// Fill with the match pattern.
-	u8* out_match_limit = out + match_len;
-	do {
-	  *(u64*)(out+0) = match_pattern;
-	  *(u64*)(out+sizeof(u64)) = match_pattern;
-	  out += 16;
-	} while(likely(out < out_match_limit));
-
-	// Fix speculative overrun
-	out = out_match_limit;
-	
-      } else {
-	// Poorly aligned overlap - let memmove() deal with it.
-	memmove(out, match, match_len);
-	out += match_len;
+      xxh32_update(state, out_chunk_start, out - out_chunk_start);
+
+      // Stopped short of the chunk, or reached the last chunk - near the end of the buffers
+      if(out < out_stop || out_stop == out_fast_limit) {
+	break;
       }
     }
   }
 
-  // Slow mode with no speculative look-ahead for end of buffers where speculative
-  //   look-ahead would overrun input or output buffers.
- slow: {
-    size_t out_so_far = out - out_start;
-    size_t in_so_far = in - (const u8*)in_void;
-    
-    ssize_t slow_rc = lz4_decode_block_default(out, out_len - out_so_far, in, in_len - in_so_far);
-    
-    if(slow_rc < 0) {
-      // Error code
-      return slow_rc;
-    }
-    
-    return out_so_far + slow_rc;
+  // Slow mode for the end of the block - the tail is short so hash it in one go.
+  size_t out_so_far = out - out_start;
+  size_t in_so_far = in - (const u8*)in_void;
+
+  ssize_t slow_rc = lz4_decode_sequences_default(window_start, dict, dict_len, out, out_len - out_so_far, SIZE_MAX, in, in_len - in_so_far);
+
+  if(slow_rc < 0) {
+    // Error code
+    return slow_rc;
   }
+
+  xxh32_update(state, out, slow_rc);
+
+  return out_so_far + slow_rc;
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_prefix_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, xxh32_state* state) {
+  // Matches can never reach back further than the lz4 window.
+  size_t window_len = prefix_len < LZ4_WINDOW_SIZE ? prefix_len : LZ4_WINDOW_SIZE;
+
+  return decode_block_hash_window((u8*)out_void - window_len, 0, 0, out_void, out_len, in_void, in_len, state);
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_dict_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const void* dict_void, const size_t dict_len, xxh32_state* state) {
+  // Only the tail of the dictionary that fits in the lz4 window can be referenced.
+  size_t window_dict_len = dict_len < LZ4_WINDOW_SIZE ? dict_len : LZ4_WINDOW_SIZE;
+  const u8* window_dict = (const u8*)dict_void + (dict_len - window_dict_len);
+
+  return decode_block_hash_window((u8*)out_void, window_dict, window_dict_len, out_void, out_len, in_void, in_len, state);
+}
+
+// @return decoded data length or -ve error val
+ssize_t lz4_decode_block_with_prefix_dict_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, const void* dict_void, const size_t dict_len, xxh32_state* state) {
+  u8* window_start;
+  const u8* window_dict;
+  size_t window_dict_len;
+  prefix_dict_window((u8*)out_void, prefix_len, (const u8*)dict_void, dict_len, &window_start, &window_dict, &window_dict_len);
+
+  return decode_block_hash_window(window_start, window_dict, window_dict_len, out_void, out_len, in_void, in_len, state);
 }
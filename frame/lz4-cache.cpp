@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <thread>
+
+#include "lz4-cache.h"
+#include "lz4-frame.h"
+#include "types.h"
+
+namespace Lz4 {
+
+  namespace Cache {
+
+    // Fewer shards if need be so that each shard holds at least one block.
+    static size_t n_shards_for(const size_t budget, const size_t block_max_bytes, const size_t n_shards) {
+      return std::max((size_t)1, std::min(n_shards, budget / std::max((size_t)1, block_max_bytes)));
+    }
+
+    BlockCache::BlockCache(const size_t budget, const size_t block_max_bytes, const size_t n_shards)
+      : shard_budget(budget / n_shards_for(budget, block_max_bytes, n_shards)),
+	block_capacity(block_max_bytes),
+	n_shards(n_shards_for(budget, block_max_bytes, n_shards)),
+	shards(new Shard[this->n_shards]),
+	next_file_id(0) {}
+
+    Frame::Error BlockCache::get(const u64 file_id, const u64 block, const size_t decoded_len, const DecodeFn& decode, BlockPtr* out) {
+      const Key key = { file_id, block };
+      Shard& shard = shard_for(key);
+
+      {
+	// Hit path - no lock. The map can not be freed while this thread is counted as a reader.
+	std::atomic<u64>& readers = shard.readers[shard.epoch.load() & 1];
+	readers.fetch_add(1);
+
+	const Map* map = shard.map.load();
+	Map::const_iterator it = map->find(key);
+
+	if(it != map->end()) {
+	  Entry* hit = it->second.get();
+	  hit->last_used.store(shard.tick.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	  shard.hits.fetch_add(1, std::memory_order_relaxed);
+
+	  if(hit->ready.load(std::memory_order_acquire)) {
+	    *out = hit->block;
+	    readers.fetch_sub(1);
+	    return Frame::Error::OK;
+	  }
+
+	  // In flight - wait for the decode outside the read side
+	  std::shared_ptr<Entry> in_flight = it->second;
+	  readers.fetch_sub(1);
+	  return take(shard, in_flight.get(), out);
+	}
+
+	readers.fetch_sub(1);
+      }
+
+      std::promise<Result> promise;
+      std::shared_ptr<Entry> entry;
+
+      {
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	const Map* map = shard.map.load();
+
+	// Another thread may have added the block since the lookup
+	Map::const_iterator it = map->find(key);
+	if(it != map->end()) {
+	  std::shared_ptr<Entry> found = it->second;
+	  found->last_used.store(shard.tick.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	  shard.hits.fetch_add(1, std::memory_order_relaxed);
+	  lock.unlock();
+	  return take(shard, found.get(), out);
+	}
+
+	// Publish the in-flight entry so that other threads missing on it wait for this decode
+	entry = std::make_shared<Entry>(promise.get_future().share(), shard.tick.fetch_add(1, std::memory_order_relaxed) + 1);
+	Map* new_map = new Map(*map);
+	(*new_map)[key] = entry;
+	publish(shard, new_map);
+      }
+
+      shard.decodes.fetch_add(1, std::memory_order_relaxed);
+
+      Result result;
+      try {
+	std::shared_ptr<DecodedBlock> decoded = std::make_shared<DecodedBlock>(decoded_len);
+	result.error = decode(decoded.get());
+	if(result.error == Frame::Error::OK) {
+	  result.block = decoded;
+	}
+      } catch(...) {
+	// Do not leave waiters hanging, nor the entry in the cache
+	promise.set_exception(std::current_exception());
+	result.error = Frame::Error::BLOCK_DECODE;
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	settle(shard, key, entry.get(), result);
+	throw;
+      }
+
+      {
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	settle(shard, key, entry.get(), result);
+      }
+      promise.set_value(result);
+
+      *out = result.block;
+      return result.error;
+    }
+
+    Frame::Error BlockCache::take(Shard& shard, Entry* entry, BlockPtr* out) {
+      if(entry->ready.load(std::memory_order_acquire)) {
+	*out = entry->block;
+	return Frame::Error::OK;
+      }
+
+      shard.waits.fetch_add(1, std::memory_order_relaxed);
+      const Result& result = entry->result.get();
+      *out = result.block;
+      return result.error;
+    }
+
+    void BlockCache::publish(Shard& shard, const Map* new_map) {
+      const Map* old_map = shard.map.exchange(new_map);
+
+      // Readers that started before the exchange are counted under the current epoch
+      //   parity, or the other one if they read the epoch before the last flip - wait
+      //   for both in turn, while new readers count under the flipped parity.
+      for(int i = 0; i < 2; i++) {
+	const u64 parity = shard.epoch.fetch_add(1) & 1;
+	while(shard.readers[parity].load() != 0) {
+	  std::this_thread::yield();
+	}
+      }
+
+      delete old_map;
+    }
+
+    void BlockCache::settle(Shard& shard, const Key& key, Entry* entry, const Result& result) {
+      const Map* map = shard.map.load();
+
+      if(result.error != Frame::Error::OK) {
+	Map* new_map = new Map(*map);
+	new_map->erase(key);
+	publish(shard, new_map);
+	return;
+      }
+
+      entry->block = result.block;
+      entry->ready.store(true, std::memory_order_release);
+      shard.bytes += result.block->len;
+
+      // Evict the least recently used decoded blocks - in-flight blocks are passed over.
+      Map* new_map = 0;
+
+      while(shard.bytes > shard_budget) {
+	const Map& current = new_map ? *new_map : *map;
+	Map::const_iterator victim = current.end();
+
+	for(Map::const_iterator it = current.begin(); it != current.end(); ++it) {
+	  if(it->second->ready.load(std::memory_order_relaxed)
+	     && (victim == current.end() || it->second->last_used.load(std::memory_order_relaxed) < victim->second->last_used.load(std::memory_order_relaxed))) {
+	    victim = it;
+	  }
+	}
+
+	if(victim == current.end()) {
+	  break;
+	}
+
+	if(!new_map) {
+	  new_map = new Map(*map);
+	  victim = new_map->find(victim->first);
+	}
+
+	shard.bytes -= victim->second->block->len;
+	new_map->erase(victim);
+	shard.evictions.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      if(new_map) {
+	publish(shard, new_map);
+      }
+    }
+
+    Stats BlockCache::stats() const {
+      Stats stats = {};
+
+      for(size_t i = 0; i < n_shards; i++) {
+	Shard& shard = shards[i];
+
+	stats.hits += shard.hits.load(std::memory_order_relaxed);
+	stats.waits += shard.waits.load(std::memory_order_relaxed);
+	stats.decodes += shard.decodes.load(std::memory_order_relaxed);
+	stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	stats.blocks += shard.map.load()->size();
+	stats.bytes += shard.bytes;
+      }
+
+      return stats;
+    }
+
+  } // namespace Cache
+
+} // namespace Lz4
@@ -0,0 +1,295 @@
+#include <cstddef>
+#include <cstdint>
+
+#include "lz4-frame.h"
+#include "types.h"
+#include "util.h"
+#include "xxhash32.h"
+
+namespace Lz4 {
+
+  namespace Frame {
+
+    const char* error_message(const Error error) {
+      switch(error) {
+      case Error::OK: return "No error";
+      case Error::HEADER_TOO_SHORT: return "Input buffer too short for lz4 frame header";
+      case Error::BAD_MAGIC: return "Invalid lz frame magic number";
+      case Error::BAD_VERSION: return "Unrecognized lz4 frame version number";
+      case Error::RESERVED_FLG_BIT: return "Reserved bit 1 in lz4 flg field is not 0";
+      case Error::RESERVED_BD_BITS: return "Reserved bits in lz4 bd field are not 0";
+      case Error::BAD_BLOCK_MAX_SIZE: return "Invalid block max size in lz4 bd field";
+      case Error::HEADER_CHECKSUM: return "Invalid lz4 frame header checksum";
+      case Error::BLOCK_HEADER_TOO_SHORT: return "Input buffer too short for minimum lz4 block header";
+      case Error::BLOCK_TOO_LONG: return "Block size is greater than remaining buffer";
+      case Error::BLOCK_TOO_LARGE: return "Block is larger than block max size";
+      case Error::TRAILER_TOO_SHORT: return "Input buffer too short for lz4 frame content checksum";
+      case Error::INDEX_TOO_SHORT: return "Seek index is truncated";
+      case Error::INDEX_BAD_MAGIC: return "Invalid seek index magic number";
+      case Error::INDEX_CHECKSUM: return "Seek index checksum mismatch";
+      case Error::INDEX_MISMATCH: return "Seek index does not match the lz4 frame";
+      case Error::LINKED_BLOCKS: return "Random access needs an lz4 frame with independent blocks";
+      case Error::BLOCK_CHECKSUM: return "Block checksum mismatch";
+      case Error::BLOCK_DECODE: return "Block decode failed";
+      case Error::CACHE_TOO_SMALL: return "Block cache is sized for smaller blocks than the lz4 frame block max size";
+      case Error::SKIPPABLE_TOO_LONG: return "Skippable frame is longer than the remaining buffer";
+      }
+      return "Unknown lz4 frame error";
+    }
+
+    Error parse_header(const u8* buf, const size_t buf_len, Header* header) {
+
+      const size_t min_header_len = sizeof(Header::magic) + sizeof(Descriptor::flg)
+	+ sizeof(Descriptor::bd) + sizeof(Descriptor::hc);
+
+      if(buf_len < sizeof(Header::magic)) {
+	return Error::HEADER_TOO_SHORT;
+      }
+
+      const u32 magic = u32_at_offset(buf, 0);
+
+      // A legacy header is just the magic number - an empty legacy frame is nothing more
+      if(magic == LZ4_LEGACY_MAGIC) {
+	const u8 flg = (Flg::VERSION_01 << Flg::VERSION_SHIFT) | Flg::BLOCK_INDEP_FLAG;
+	const u8 bd = Bd::BLOCK_MAX_SIZE_LEGACY << Bd::BLOCK_MAX_SIZE_SHIFT;
+	*header = Header(sizeof(Header::magic), magic, flg, bd, 0, 0, 0);
+	return Error::OK;
+      }
+
+      if(magic != LZ4_FRAME_MAGIC) {
+	return Error::BAD_MAGIC;
+      }
+
+      if(buf_len < min_header_len) {
+	return Error::HEADER_TOO_SHORT;
+      }
+
+      size_t header_len = min_header_len;
+
+      buf += sizeof(Header::magic);
+
+      const u8 flg = *buf++;
+
+      if(Flg::version(flg) != Flg::VERSION_01) {
+	return Error::BAD_VERSION;
+      }
+
+      if(Flg::flag_is_set(flg, Flg::RESERVED_1_FLAG)) {
+	return Error::RESERVED_FLG_BIT;
+      }
+
+      const u8 bd = *buf++;
+
+      if(Bd::reserved_7(bd) || Bd::reserved_3_2_1_0(bd) != 0) {
+	return Error::RESERVED_BD_BITS;
+      }
+
+      if(!Bd::block_max_size_is_valid(bd)) {
+	return Error::BAD_BLOCK_MAX_SIZE;
+      }
+
+      u64 content_size = 0;
+
+      if(Flg::flag_is_set(flg, Flg::CONTENT_SIZE_FLAG)) {
+	header_len += sizeof(Descriptor::content_size);
+
+	if(buf_len < header_len) {
+	  return Error::HEADER_TOO_SHORT;
+	}
+
+	content_size = u64_at_offset(buf, 0);
+
+	buf += sizeof(Descriptor::content_size);
+      }
+
+      u32 dict_id = 0;
+
+      if(Flg::flag_is_set(flg, Flg::DICT_ID_FLAG)) {
+	header_len += sizeof(Descriptor::dict_id);
+
+	if(buf_len < header_len) {
+	  return Error::HEADER_TOO_SHORT;
+	}
+
+	dict_id = u32_at_offset(buf, 0);
+
+	buf += sizeof(Descriptor::dict_id);
+      }
+
+      const u8 hc = *buf++;
+
+      // The header checksum is the second byte of the xxHash32 of the descriptor, from flg up to hc.
+      const u8* descriptor_start = buf - header_len + sizeof(Header::magic);
+      const size_t descriptor_len = header_len - sizeof(Header::magic) - sizeof(Descriptor::hc);
+      if(((xxh32(descriptor_start, descriptor_len, 0) >> 8) & 0xff) != hc) {
+	return Error::HEADER_CHECKSUM;
+      }
+
+      *header = Header(header_len, magic, flg, bd, content_size, dict_id, hc);
+      return Error::OK;
+    }
+
+    Error FrameReader::open(const u8* buf, const size_t buf_len) {
+      last_error = parse_header(buf, buf_len, &frame_header);
+      at_end = last_error != Error::OK;
+
+      frame_start = buf;
+      buf_limit = buf + buf_len;
+      pos = at_end ? buf : buf + frame_header.len;
+      legacy = frame_header.is_legacy();
+
+      block_max_bytes = frame_header.descriptor.bd_block_max_bytes();
+      checksum_len = frame_header.descriptor.flg_is_set(Flg::BLOCK_CHECKSUM_FLAG) ? sizeof(Block::Trailer::block_checksum) : 0;
+      trailer_content_checksum = 0;
+
+      return last_error;
+    }
+
+    bool FrameReader::next(BlockView* block) {
+      if(at_end) {
+	return false;
+      }
+
+      if(legacy) {
+	return next_legacy(block);
+      }
+
+      size_t buf_len = buf_limit - pos;
+
+      if(buf_len < sizeof(Block::Header::block_size)) {
+	last_error = Error::BLOCK_HEADER_TOO_SHORT;
+	at_end = true;
+	return false;
+      }
+
+      const Block::Header block_header(u32_at_offset(pos, 0));
+      buf_len -= sizeof(Block::Header::block_size);
+
+      if(block_header.is_endmark()) {
+	size_t trailer_len = frame_header.descriptor.flg_is_set(Flg::CONTENT_CHECKSUM_FLAG) ? sizeof(Trailer::content_checksum) : 0;
+
+	if(buf_len < trailer_len) {
+	  last_error = Error::TRAILER_TOO_SHORT;
+	} else {
+	  if(trailer_len != 0) {
+	    trailer_content_checksum = u32_at_offset(pos, sizeof(Block::Header::block_size));
+	  }
+	  pos += sizeof(Block::Header::block_size) + trailer_len;
+	}
+	at_end = true;
+	return false;
+      }
+
+      const u32 data_len = block_header.data_length();
+
+      if(buf_len < data_len + checksum_len) {
+	last_error = Error::BLOCK_TOO_LONG;
+	at_end = true;
+	return false;
+      }
+
+      if(data_len > block_max_bytes) {
+	last_error = Error::BLOCK_TOO_LARGE;
+	at_end = true;
+	return false;
+      }
+
+      const u8* data = pos + sizeof(Block::Header::block_size);
+
+      block->data = data;
+      block->len = data_len;
+      block->compressed = block_header.is_compressed();
+      block->has_checksum = checksum_len != 0;
+      block->checksum = checksum_len != 0 ? u32_at_offset(data, data_len) : 0;
+
+      pos = data + data_len + checksum_len;
+      return true;
+    }
+
+    bool FrameReader::next_legacy(BlockView* block) {
+      size_t buf_len = buf_limit - pos;
+
+      // The end of the input, or the next frame
+      if(buf_len == 0) {
+	at_end = true;
+	return false;
+      }
+
+      if(buf_len < sizeof(Block::Header::block_size)) {
+	last_error = Error::BLOCK_HEADER_TOO_SHORT;
+	at_end = true;
+	return false;
+      }
+
+      const u32 data_len = u32_at_offset(pos, 0);
+      buf_len -= sizeof(Block::Header::block_size);
+
+      if(data_len > LZ4_LEGACY_BLOCK_BOUND) {
+	at_end = true;
+	return false;
+      }
+
+      if(buf_len < data_len) {
+	last_error = Error::BLOCK_TOO_LONG;
+	at_end = true;
+	return false;
+      }
+
+      block->data = pos + sizeof(Block::Header::block_size);
+      block->len = data_len;
+      block->compressed = true;
+      block->has_checksum = false;
+      block->checksum = 0;
+
+      pos = block->data + data_len;
+      return true;
+    }
+
+    bool StreamReader::next_frame() {
+      if(in_frame) {
+	BlockView block;
+	while(current.next(&block)) {}
+
+	in_frame = false;
+	if(current.error() != Error::OK) {
+	  last_error = current.error();
+	  pos = buf_limit;
+	  return false;
+	}
+	pos += current.frame_len();
+      }
+
+      while(pos != buf_limit) {
+	const size_t buf_len = buf_limit - pos;
+
+	if(buf_len >= sizeof(u32) && is_skippable_magic(u32_at_offset(pos, 0))) {
+	  if(buf_len < LZ4_SKIPPABLE_HEADER_LEN) {
+	    last_error = Error::HEADER_TOO_SHORT;
+	  } else if(buf_len - LZ4_SKIPPABLE_HEADER_LEN < u32_at_offset(pos, sizeof(u32))) {
+	    last_error = Error::SKIPPABLE_TOO_LONG;
+	  } else {
+	    pos += LZ4_SKIPPABLE_HEADER_LEN + u32_at_offset(pos, sizeof(u32));
+	    n_skippable++;
+	    continue;
+	  }
+	  pos = buf_limit;
+	  return false;
+	}
+
+	last_error = current.open(pos, buf_len);
+	if(last_error != Error::OK) {
+	  pos = buf_limit;
+	  return false;
+	}
+
+	in_frame = true;
+	n_frames++;
+	return true;
+      }
+
+      return false;
+    }
+
+  } // namespace Frame
+
+} // namespace Lz4
@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+// memcpy
+#include <cstring>
+
+#include "decode.h"
+#include "lz4-frame.h"
+#include "lz4-index.h"
+#include "types.h"
+#include "util.h"
+#include "xxhash32.h"
+
+namespace Lz4 {
+
+  namespace Index {
+
+    static void append_u32(std::string& out, const u32 val) {
+      // Little-endian, as the frame format
+      const char bytes[sizeof(u32)] = { (char)val, (char)(val >> 8), (char)(val >> 16), (char)(val >> 24) };
+      out.append(bytes, sizeof(bytes));
+    }
+
+    void SeekIndex::add(const u32 block_len, const u32 decoded_len) {
+      BlockEntry entry;
+      entry.blocks_offset = entries.empty() ? 0 : entries.back().blocks_offset + entries.back().block_len;
+      entry.content_offset = total_content_len;
+      entry.block_len = block_len;
+      entry.decoded_len = decoded_len;
+
+      entries.push_back(entry);
+      total_content_len += decoded_len;
+    }
+
+    Frame::Error SeekIndex::build(Frame::FrameReader reader) {
+      entries.clear();
+      total_content_len = 0;
+
+      // Block offsets are from the first block
+      Frame::Error error = reader.rewind();
+      if(error != Frame::Error::OK) {
+	return error;
+      }
+
+      const size_t checksum_len = reader.descriptor().flg_is_set(Frame::Flg::BLOCK_CHECKSUM_FLAG) ? sizeof(Block::Trailer::block_checksum) : 0;
+      const size_t block_max_bytes = reader.descriptor().bd_block_max_bytes();
+      Frame::BlockView block;
+
+      while(reader.next(&block)) {
+	ssize_t decoded_len = block.compressed ? lz4_decode_block_len(block.data, block.len) : block.len;
+	if(decoded_len < 0 || (size_t)decoded_len > block_max_bytes) {
+	  return Frame::Error::BLOCK_DECODE;
+	}
+
+	add(sizeof(Block::Header::block_size) + block.len + checksum_len, (u32)decoded_len);
+      }
+
+      return reader.error();
+    }
+
+    Frame::Error SeekIndex::load(const u8* buf, const size_t buf_len) {
+      entries.clear();
+      total_content_len = 0;
+
+      if(buf_len < FOOTER_LEN) {
+	return Frame::Error::INDEX_TOO_SHORT;
+      }
+
+      const u8* footer = buf + buf_len - FOOTER_LEN;
+      if(u32_at_offset(footer, 2*sizeof(u32)) != LZ4_INDEX_MAGIC) {
+	return Frame::Error::INDEX_BAD_MAGIC;
+      }
+
+      const size_t n = u32_at_offset(footer, 0);
+      if(n != (buf_len - FOOTER_LEN) / ENTRY_LEN || (buf_len - FOOTER_LEN) % ENTRY_LEN != 0) {
+	return Frame::Error::INDEX_TOO_SHORT;
+      }
+
+      if(xxh32(buf, n*ENTRY_LEN, 0) != u32_at_offset(footer, sizeof(u32))) {
+	return Frame::Error::INDEX_CHECKSUM;
+      }
+
+      entries.reserve(n);
+      for(size_t i = 0; i < n; i++) {
+	add(u32_at_offset(buf, i*ENTRY_LEN), u32_at_offset(buf, i*ENTRY_LEN + sizeof(u32)));
+      }
+
+      return Frame::Error::OK;
+    }
+
+    Frame::Error SeekIndex::load_trailer(const u8* buf, const size_t buf_len) {
+      if(buf_len < Frame::LZ4_SKIPPABLE_HEADER_LEN + FOOTER_LEN
+	 || u32_at_offset(buf, buf_len - sizeof(u32)) != LZ4_INDEX_MAGIC) {
+	return Frame::Error::INDEX_BAD_MAGIC;
+      }
+
+      // The entry count in the footer gives the length of the whole trailer
+      const size_t n = u32_at_offset(buf, buf_len - FOOTER_LEN);
+      const size_t index_len = n*ENTRY_LEN + FOOTER_LEN;
+      if(buf_len - Frame::LZ4_SKIPPABLE_HEADER_LEN < index_len) {
+	return Frame::Error::INDEX_TOO_SHORT;
+      }
+
+      const u8* trailer = buf + buf_len - index_len - Frame::LZ4_SKIPPABLE_HEADER_LEN;
+      if(u32_at_offset(trailer, 0) != LZ4_INDEX_SKIPPABLE_MAGIC || u32_at_offset(trailer, sizeof(u32)) != index_len) {
+	return Frame::Error::INDEX_BAD_MAGIC;
+      }
+
+      return load(trailer + Frame::LZ4_SKIPPABLE_HEADER_LEN, index_len);
+    }
+
+    void SeekIndex::serialise(std::string& out) const {
+      size_t entries_start = out.length();
+
+      for(const BlockEntry& entry : entries) {
+	append_u32(out, entry.block_len);
+	append_u32(out, entry.decoded_len);
+      }
+
+      u32 checksum = xxh32(out.data() + entries_start, out.length() - entries_start, 0);
+
+      append_u32(out, (u32)entries.size());
+      append_u32(out, checksum);
+      append_u32(out, LZ4_INDEX_MAGIC);
+    }
+
+    void SeekIndex::serialise_trailer(std::string& out) const {
+      append_u32(out, LZ4_INDEX_SKIPPABLE_MAGIC);
+      append_u32(out, (u32)(entries.size()*ENTRY_LEN + FOOTER_LEN));
+      serialise(out);
+    }
+
+    size_t SeekIndex::find(const u64 offset) const {
+      if(offset >= total_content_len) {
+	return entries.size();
+      }
+
+      // Last block starting at or before offset - empty blocks are skipped over since
+      //   the next block has the same content offset.
+      auto it = std::upper_bound(entries.begin(), entries.end(), offset, [](const u64 offset, const BlockEntry& entry) {
+	  return offset < entry.content_offset;
+	});
+      return (it - entries.begin()) - 1;
+    }
+
+    Frame::Error SeekableReader::open(const u8* buf, const size_t buf_len, const SeekIndex* index, const u8* dict, const size_t dict_len) {
+      Frame::Header header;
+      Frame::Error error = Frame::parse_header(buf, buf_len, &header);
+      if(error != Frame::Error::OK) {
+	return error;
+      }
+
+      if(!header.descriptor.flg_is_set(Frame::Flg::BLOCK_INDEP_FLAG)) {
+	return Frame::Error::LINKED_BLOCKS;
+      }
+
+      if(index->n_blocks() != 0) {
+	const BlockEntry& last = index->entry(index->n_blocks() - 1);
+	if(buf_len - header.len < last.blocks_offset + last.block_len) {
+	  return Frame::Error::INDEX_MISMATCH;
+	}
+      }
+
+      this->blocks = buf + header.len;
+      this->blocks_len = buf_len - header.len;
+      this->descriptor = header.descriptor;
+      this->index = index;
+      this->dict = dict;
+      this->dict_len = dict_len;
+      scratch.reset(new u8[header.descriptor.bd_block_max_bytes()]);
+
+      return Frame::Error::OK;
+    }
+
+    Frame::Error SeekableReader::block_at(const BlockEntry& entry, Frame::BlockView* block) const {
+      const size_t checksum_len = descriptor.flg_is_set(Frame::Flg::BLOCK_CHECKSUM_FLAG) ? sizeof(Block::Trailer::block_checksum) : 0;
+
+      if(blocks_len < entry.blocks_offset + entry.block_len || entry.block_len < sizeof(Block::Header::block_size) + checksum_len) {
+	return Frame::Error::INDEX_MISMATCH;
+      }
+
+      const u8* block_start = blocks + entry.blocks_offset;
+      const Block::Header block_header(u32_at_offset(block_start, 0));
+
+      if(block_header.is_endmark() || sizeof(Block::Header::block_size) + block_header.data_length() + checksum_len != entry.block_len) {
+	return Frame::Error::INDEX_MISMATCH;
+      }
+
+      block->data = block_start + sizeof(Block::Header::block_size);
+      block->len = block_header.data_length();
+      block->compressed = block_header.is_compressed();
+      block->has_checksum = checksum_len != 0;
+      block->checksum = checksum_len != 0 ? u32_at_offset(block->data, block->len) : 0;
+
+      return Frame::Error::OK;
+    }
+
+    Frame::Error SeekableReader::decode_block(const BlockEntry& entry, const Frame::BlockView& block, u8* out, const size_t out_len) const {
+      if(!block.checksum_ok()) {
+	return Frame::Error::BLOCK_CHECKSUM;
+      }
+
+      ssize_t rc = lz4_decode_block_with_dict(out, out_len, block.data, block.len, dict, dict_len);
+      if(rc < 0) {
+	return Frame::Error::BLOCK_DECODE;
+      }
+      if((size_t)rc != entry.decoded_len) {
+	return Frame::Error::INDEX_MISMATCH;
+      }
+
+      return Frame::Error::OK;
+    }
+
+    Frame::Error SeekableReader::use_cache(Cache::BlockCache* cache, const u64 file_id) {
+      if(cache->block_max_bytes() < descriptor.bd_block_max_bytes()) {
+	return Frame::Error::CACHE_TOO_SMALL;
+      }
+
+      this->cache = cache;
+      this->cache_file_id = file_id;
+      return Frame::Error::OK;
+    }
+
+    Frame::Error SeekableReader::pread_uncompressed(void* out_void, const size_t len, const u64 offset, size_t* read_len) {
+      u8* out = (u8*)out_void;
+      const u64 end = std::min(offset + len, index->content_len());
+      const size_t block_max_bytes = descriptor.bd_block_max_bytes();
+
+      *read_len = 0;
+      u64 pos = offset;
+
+      for(size_t i = index->find(offset); pos < end; i++) {
+	const BlockEntry& entry = index->entry(i);
+	Frame::BlockView block;
+
+	Frame::Error error = block_at(entry, &block);
+	if(error != Frame::Error::OK) {
+	  return error;
+	}
+
+	// Part of the block that is read
+	const size_t copy_start = pos - entry.content_offset;
+	const size_t copy_end = std::min(end, entry.content_offset + entry.decoded_len) - entry.content_offset;
+	u8* dst = out + (pos - offset);
+
+	if(!block.compressed) {
+	  if(block.len != entry.decoded_len) {
+	    return Frame::Error::INDEX_MISMATCH;
+	  }
+	  if(!block.checksum_ok()) {
+	    return Frame::Error::BLOCK_CHECKSUM;
+	  }
+	  memcpy(dst, block.data + copy_start, copy_end - copy_start);
+	} else if(cache) {
+	  Cache::BlockPtr cached;
+	  error = cache->get(cache_file_id, i, entry.decoded_len, [&](Cache::DecodedBlock* decoded) {
+	      return decode_block(entry, block, decoded->data.get(), decoded->len);
+	    }, &cached);
+	  if(error != Frame::Error::OK) {
+	    return error;
+	  }
+	  memcpy(dst, cached->data.get() + copy_start, copy_end - copy_start);
+	} else {
+	  // Decode straight into the output if all of the block is read, else into scratch.
+	  const bool whole = copy_start == 0 && copy_end == entry.decoded_len;
+	  u8* block_out = whole ? dst : scratch.get();
+	  size_t block_out_len = whole ? entry.decoded_len : block_max_bytes;
+
+	  error = decode_block(entry, block, block_out, block_out_len);
+	  if(error != Frame::Error::OK) {
+	    return error;
+	  }
+
+	  if(!whole) {
+	    memcpy(dst, scratch.get() + copy_start, copy_end - copy_start);
+	  }
+	}
+
+	pos = entry.content_offset + copy_end;
+      }
+
+      *read_len = pos - offset;
+      return Frame::Error::OK;
+    }
+
+  } // namespace Index
+
+} // namespace Lz4
@@ -0,0 +1,136 @@
+// memcpy
+#include <string.h>
+
+#include "types.h"
+#include "xxhash32.h"
+
+#define XXH32_PRIME1 (2654435761U)
+#define XXH32_PRIME2 (2246822519U)
+#define XXH32_PRIME3 (3266489917U)
+#define XXH32_PRIME4 (668265263U)
+#define XXH32_PRIME5 (374761393U)
+
+// Each stripe is 4 lanes of u32
+#define XXH32_STRIPE_LEN (16)
+
+static inline u32 rotl32(u32 x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+// Assumes little-endian
+static inline u32 read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, sizeof(u32));
+  return v;
+}
+
+static inline u32 xxh32_round(u32 acc, u32 lane) {
+  acc += lane * XXH32_PRIME2;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  // Stop gcc turning the 4 lanes into SSE2 code - without a 32-bit vector multiply
+  //   that runs at about half the speed of the scalar rounds.
+  __asm__("" : "+r" (acc));
+#endif
+  acc = rotl32(acc, 13);
+  return acc * XXH32_PRIME1;
+}
+
+// Consume whole stripes from in.
+// @return pointer past the last whole stripe
+static inline const u8* xxh32_stripes(u32* acc, const u8* in, const u8* in_limit) {
+  u32 acc0 = acc[0], acc1 = acc[1], acc2 = acc[2], acc3 = acc[3];
+
+  while(in_limit - in >= XXH32_STRIPE_LEN) {
+    acc0 = xxh32_round(acc0, read32(in + 0));
+    acc1 = xxh32_round(acc1, read32(in + 4));
+    acc2 = xxh32_round(acc2, read32(in + 8));
+    acc3 = xxh32_round(acc3, read32(in + 12));
+    in += XXH32_STRIPE_LEN;
+  }
+
+  acc[0] = acc0; acc[1] = acc1; acc[2] = acc2; acc[3] = acc3;
+
+  return in;
+}
+
+void xxh32_init(xxh32_state* state, const u32 seed) {
+  state->acc[0] = seed + XXH32_PRIME1 + XXH32_PRIME2;
+  state->acc[1] = seed + XXH32_PRIME2;
+  state->acc[2] = seed;
+  state->acc[3] = seed - XXH32_PRIME1;
+  state->total_len = 0;
+  state->stripe_len = 0;
+  state->seed = seed;
+}
+
+void xxh32_update(xxh32_state* state, const void* in_void, const size_t in_len) {
+  const u8* in = (const u8*)in_void;
+  const u8* const in_limit = in + in_len;
+
+  state->total_len += in_len;
+
+  // Top up a partial stripe from the previous update first
+  if(state->stripe_len != 0) {
+    size_t fill_len = XXH32_STRIPE_LEN - state->stripe_len;
+    if(in_len < fill_len) {
+      memcpy(state->stripe + state->stripe_len, in, in_len);
+      state->stripe_len += in_len;
+      return;
+    }
+
+    memcpy(state->stripe + state->stripe_len, in, fill_len);
+    in += fill_len;
+    xxh32_stripes(state->acc, state->stripe, state->stripe + XXH32_STRIPE_LEN);
+    state->stripe_len = 0;
+  }
+
+  in = xxh32_stripes(state->acc, in, in_limit);
+
+  state->stripe_len = in_limit - in;
+  memcpy(state->stripe, in, state->stripe_len);
+}
+
+u32 xxh32_digest(const xxh32_state* state) {
+  u32 h;
+
+  if(state->total_len >= XXH32_STRIPE_LEN) {
+    h = rotl32(state->acc[0], 1) + rotl32(state->acc[1], 7) + rotl32(state->acc[2], 12) + rotl32(state->acc[3], 18);
+  } else {
+    h = state->seed + XXH32_PRIME5;
+  }
+
+  // Length modulo 2^32 as per spec
+  h += (u32)state->total_len;
+
+  const u8* p = state->stripe;
+  const u8* const p_limit = p + state->stripe_len;
+
+  while(p_limit - p >= 4) {
+    h += read32(p) * XXH32_PRIME3;
+    h = rotl32(h, 17) * XXH32_PRIME4;
+    p += 4;
+  }
+
+  while(p < p_limit) {
+    h += (*p++) * XXH32_PRIME5;
+    h = rotl32(h, 11) * XXH32_PRIME1;
+  }
+
+  // Avalanche
+  h ^= h >> 15;
+  h *= XXH32_PRIME2;
+  h ^= h >> 13;
+  h *= XXH32_PRIME3;
+  h ^= h >> 16;
+
+  return h;
+}
+
+u32 xxh32(const void* in_void, const size_t in_len, const u32 seed) {
+  xxh32_state state;
+
+  xxh32_init(&state, seed);
+  xxh32_update(&state, in_void, in_len);
+
+  return xxh32_digest(&state);
+}
@@ -0,0 +1,59 @@
+#ifndef DECODE_TEMPLATE_H
+#define DECODE_TEMPLATE_H
+
+// C++ only - compile-time specialised block decoders.
+
+#include <cstddef>
+
+#include "decode.h"
+#include "types.h"
+
+namespace Lz4 {
+
+  namespace Decode {
+
+    // Input checking of the specialised decoders.
+    enum class Checks {
+      // Input is known to be well-formed, e.g. produced by our own encoder - match
+      //   offsets and length extensions are not checked in the fast loop.
+      TRUSTED,
+      // Input may be malicious - every offset and length is checked.
+      HARDENED,
+    };
+
+    /**
+     * Decompress a compressed lz4 block.
+     * LOOKAHEAD is the width of the speculative literals and match copies - 16 or 32.
+     * BLOCK_MAX is the frame block max size (64KiB, 256KiB, 1MiB or 4MiB) - output is
+     *   never longer, and with HARDENED checks longer input is rejected.
+     * Same platform assumptions as lz4_decode_block_fast().
+     * @return size of decompressed data or -ve error code
+     */
+    template <size_t LOOKAHEAD, Checks CHECKS, size_t BLOCK_MAX>
+    ssize_t decode_block(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+
+    // The explicit instantiations in decode-template.cpp
+#define LZ4_DECODE_TEMPLATE_EXTERN(LOOKAHEAD, CHECKS)			\
+    extern template ssize_t decode_block<LOOKAHEAD, CHECKS, 64*1024>(void*, const size_t, const void*, const size_t); \
+    extern template ssize_t decode_block<LOOKAHEAD, CHECKS, 256*1024>(void*, const size_t, const void*, const size_t); \
+    extern template ssize_t decode_block<LOOKAHEAD, CHECKS, 1024*1024>(void*, const size_t, const void*, const size_t); \
+    extern template ssize_t decode_block<LOOKAHEAD, CHECKS, 4*1024*1024>(void*, const size_t, const void*, const size_t);
+
+    LZ4_DECODE_TEMPLATE_EXTERN(16, Checks::TRUSTED)
+    LZ4_DECODE_TEMPLATE_EXTERN(16, Checks::HARDENED)
+    LZ4_DECODE_TEMPLATE_EXTERN(32, Checks::TRUSTED)
+    LZ4_DECODE_TEMPLATE_EXTERN(32, Checks::HARDENED)
+
+#undef LZ4_DECODE_TEMPLATE_EXTERN
+
+    /**
+     * Pick the specialised decoder for a frame.
+     * @return decoder, or nullptr if there is no instantiation for the parameters
+     */
+    lz4_decode_block_fn* select_block_decoder(const size_t block_max_bytes, const Checks checks, const size_t lookahead = 16);
+
+  } // namespace Decode
+
+} // namespace Lz4
+
+#endif //ndef DECODE_TEMPLATE_H
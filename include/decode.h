@@ -1,7 +1,10 @@
 #ifndef DECODE_H
 #define DECODE_H
 
+#include <sys/uio.h>
+
 #include "types.h"
+#include "xxhash32.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,7 +19,19 @@ extern "C" {
 /* Insufficient space in output buffer. */
 #define LZ4_DECODE_ERR_OUTPUT_OVERFLOW 2
 /* Input buffer overrun in the middle of a sequence. */
-#define LZ4_DECODE_ERR_INPUT_OVERFLOW 2
+#define LZ4_DECODE_ERR_INPUT_OVERFLOW 3
+/* Stream decode input ended in the middle of a sequence. */
+#define LZ4_DECODE_ERR_INCOMPLETE_SEQUENCE 4
+/* Stream decode state is not usable after a previous error. */
+#define LZ4_DECODE_ERR_STREAM_STATE 5
+
+/* Maximum match offset - the history window size for linked blocks. */
+#define LZ4_WINDOW_SIZE (64*1024)
+
+/**
+ * Signature shared by the block decoders.
+ */
+typedef ssize_t lz4_decode_block_fn(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
 
 /**
  * Decompress a compressed lz4 block.
@@ -25,6 +40,35 @@ extern "C" {
  */
 extern ssize_t lz4_decode_block_fast(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
 
+/**
+ * Counters from lz4_decode_block_fast_prefetch() - accumulated over calls.
+ * Whether prefetches are useful is measured by sampling - one in every few far matches
+ *   the decoder times its first load of the match source, alternately with the prefetch
+ *   issued and with it left out as a control. Prefetches help by the difference in
+ *   mean load latency.
+ */
+typedef struct lz4_prefetch_stats {
+  // Sequences parsed ahead of the decoder - each prefetches its match source if that is
+  //   far behind the output, or else the output position, which is already in cache
+  u64 sequences_scouted;
+  // Prefetches of match sources far enough back to be cold in cache - the controls are
+  //   not prefetched
+  u64 far_prefetches;
+  // Sampled first loads of far match sources, and their total latency in TSC cycles
+  u64 prefetched_samples;
+  u64 prefetched_cycles;
+  u64 control_samples;
+  u64 control_cycles;
+} lz4_prefetch_stats;
+
+/**
+ * As lz4_decode_block_fast(), while parsing a batch of sequences ahead of the decoder
+ *   to prefetch the sources of matches that are far behind the output.
+ * Counters are added to stats if it is not 0.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_fast_prefetch(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, lz4_prefetch_stats* stats);
+
 /**
  * Decompress a compressed lz4 block.
  * Default impl that works on all platforms.
@@ -32,6 +76,355 @@ extern ssize_t lz4_decode_block_fast(void* out_void, const size_t out_len, const
  */
 extern ssize_t lz4_decode_block_default(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
 
+/**
+ * Decompress a compressed lz4 block, branching on a 256-entry table of token flags
+ *   rather than on length compares.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_table(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+
+/**
+ * Decompress a compressed lz4 block in two phases per batch of sequences - first
+ *   parse and bounds-check the sequences into arrays, then run all of the copies.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_two_phase(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+
+/* Maximum number of blocks advanced in lockstep by lz4_decode_blocks_interleaved(). */
+#define LZ4_INTERLEAVE_MAX 4
+
+/**
+ * Decompress n_blocks independent compressed lz4 blocks on one core.
+ * Up to LZ4_INTERLEAVE_MAX blocks at a time are advanced one sequence each in turn so
+ *   that the work of the blocks overlaps in the CPU - this helps latency-bound decode
+ *   of many small blocks more than it helps bandwidth.
+ * results[i] is set to the size of decompressed data of block i or -ve error code.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return 0 or the first -ve error code in results
+ */
+extern ssize_t lz4_decode_blocks_interleaved(const size_t n_blocks, void* const outs[], const size_t out_lens[], const void* const ins[], const size_t in_lens[], ssize_t results[]);
+
+/* One block of lz4_decode_blocks_batch() - a compressed block and its output buffer. */
+typedef struct lz4_block_desc {
+  void* out;
+  size_t out_len;
+  const void* in;
+  size_t in_len;
+} lz4_block_desc;
+
+/**
+ * Decompress n_blocks independent compressed lz4 blocks in one call.
+ * For many small blocks, such as cached values, where a call per block is a measurable
+ *   overhead. Each block is decoded as lz4_decode_block_fast() would, with the inputs of
+ *   the next few blocks prefetched ahead of decode.
+ * n_interleave blocks at a time, up to LZ4_INTERLEAVE_MAX, are advanced in lockstep as
+ *   by lz4_decode_blocks_interleaved() - 1 decodes the blocks one after another.
+ * results[i] is set to the size of decompressed data of block i or -ve error code.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return 0 or the first -ve error code in results
+ */
+extern ssize_t lz4_decode_blocks_batch(const lz4_block_desc* descs, const size_t n_blocks, size_t n_interleave, ssize_t results[]);
+
+/* Bytes needed in an in-place decode buffer beyond the decompressed size, for a
+   compressed block of in_len bytes. Compressed data can only be longer than its
+   decompressed data by 1 byte per 255 literals plus a few bytes of the last sequences -
+   the rest is room for the fast loop to run to near the end of the block. */
+#define LZ4_DECODE_IN_PLACE_MARGIN(in_len) ((in_len)/255 + 64)
+/* Buffer size for in-place decode of a block of at most out_len decompressed bytes. */
+#define LZ4_DECODE_IN_PLACE_BUF_LEN(out_len, in_len) ((out_len) + LZ4_DECODE_IN_PLACE_MARGIN(in_len))
+
+/**
+ * Decompress a compressed lz4 block that sits at the end of its own output buffer - the
+ *   in_len bytes of input are the last in_len bytes of the buf_len bytes at buf_void.
+ * Decoded data is written from buf_void and never overwrites input that is still to be
+ *   read, provided buf_len is at least LZ4_DECODE_IN_PLACE_BUF_LEN() of the decompressed
+ *   size - otherwise this fails with LZ4_DECODE_ERR_OUTPUT_OVERFLOW.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_in_place(void* buf_void, const size_t buf_len, const size_t in_len);
+
+/**
+ * Decompress a compressed lz4 block into a list of output segments, such as pages that
+ *   are not contiguous, in order - as if they were one buffer.
+ * Matches may reach back across any number of segments. Only sequences that run into
+ *   the next segment, or copy from an earlier one, are decoded by the exact slow path.
+ * Fails with LZ4_DECODE_ERR_OUTPUT_OVERFLOW if the segments are too small in total.
+ * Same platform assumptions as lz4_decode_block_fast().
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_iov(const struct iovec* iov, const int iovcnt, const void* in_void, const size_t in_len);
+
+/**
+ * Decompress a compressed lz4 block whose matches may reach back into previously
+ *   decoded output, as for linked blocks in an lz4 frame.
+ * The prefix_len bytes immediately before out_void are the history - only the last
+ *   LZ4_WINDOW_SIZE bytes of it are ever referenced.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_prefix(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len);
+
+/**
+ * Decompress a compressed lz4 block that was compressed with an external dictionary.
+ * The dictionary is treated as if it immediately preceded out_void, so a match can
+ *   start in the dictionary and run on into the output. Only the last LZ4_WINDOW_SIZE
+ *   bytes of the dictionary are ever referenced.
+ * The dictionary is not modified and can be shared between threads.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_dict(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const void* dict_void, const size_t dict_len);
+
+/**
+ * Decompress a compressed lz4 block whose matches may reach back through the prefix_len
+ *   bytes immediately before out_void and then on into an external dictionary - as for
+ *   the first blocks of a linked frame with a dictionary, decoded where the earlier
+ *   blocks of the frame were decoded.
+ * Only the last LZ4_WINDOW_SIZE bytes of prefix and dictionary together are ever
+ *   referenced, so once prefix_len reaches LZ4_WINDOW_SIZE this is
+ *   lz4_decode_block_with_prefix().
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_prefix_dict(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, const void* dict_void, const size_t dict_len);
+
+/**
+ * Decompress the start of a compressed lz4 block, stopping at the end of the first
+ *   sequence that reaches target_len bytes of output.
+ * Output may run past target_len to the end of that sequence, up to out_capacity.
+ * @return size of decompressed data - at least target_len unless the whole block is
+ *   shorter - or -ve error code
+ */
+extern ssize_t lz4_decode_block_partial(void* out_void, const size_t target_len, const size_t out_capacity, const void* in_void, const size_t in_len);
+
+/**
+ * Length that a compressed lz4 block decompresses to, from the sequence lengths alone -
+ *   much cheaper than decoding it, for indexing.
+ * The block structure is checked, but not the match offsets.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_len(const void* in_void, const size_t in_len);
+
+/**
+ * As lz4_decode_block_with_prefix(), also feeding the decompressed data to an xxHash32
+ *   state for the frame content checksum. The output is hashed piecewise as it is
+ *   decoded rather than in a second pass over the whole block.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_prefix_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, xxh32_state* state);
+
+/**
+ * As lz4_decode_block_with_dict(), also feeding the decompressed data to an xxHash32
+ *   state for the frame content checksum.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_dict_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const void* dict_void, const size_t dict_len, xxh32_state* state);
+
+/**
+ * As lz4_decode_block_with_prefix_dict(), also feeding the decompressed data to an
+ *   xxHash32 state for the frame content checksum.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_with_prefix_dict_hash(void* out_void, const size_t out_len, const void* in_void, const size_t in_len, const size_t prefix_len, const void* dict_void, const size_t dict_len, xxh32_state* state);
+
+/*
+ * Stages of the resumable stream decoder - where the input ran out.
+ */
+#define LZ4_STREAM_STAGE_TOKEN 0
+#define LZ4_STREAM_STAGE_LITS_LEN_EXTENSION 1
+#define LZ4_STREAM_STAGE_LITS 2
+#define LZ4_STREAM_STAGE_OFFSET_LO 3
+#define LZ4_STREAM_STAGE_OFFSET_HI 4
+#define LZ4_STREAM_STAGE_MATCH_LEN_EXTENSION 5
+#define LZ4_STREAM_STAGE_MATCH 6
+#define LZ4_STREAM_STAGE_ERROR 7
+
+/**
+ * State of a resumable block decode - see lz4_stream_decode_update().
+ */
+typedef struct lz4_stream_decode_state {
+  // Matches may reach back as far as window_start
+  u8* window_start;
+  u8* out_start;
+  u8* out;
+  u8* out_limit;
+
+  // LZ4_STREAM_STAGE_*
+  int stage;
+
+  // Remaining literals, or lits length so far in LZ4_STREAM_STAGE_LITS_LEN_EXTENSION
+  size_t lits_len;
+  size_t match_len;
+  size_t match_offset;
+} lz4_stream_decode_state;
+
+/**
+ * Start a resumable decode of a compressed lz4 block into out_void.
+ * The prefix_len bytes immediately before out_void are history for linked blocks - 0 otherwise.
+ */
+extern void lz4_stream_decode_init(lz4_stream_decode_state* state, void* out_void, const size_t out_len, const size_t prefix_len);
+
+/**
+ * Decode the next chunk of a compressed lz4 block.
+ * Chunks can split the block anywhere - the decode is suspended in the middle of a
+ *   sequence if necessary and resumed by the next chunk.
+ * @return size of data decompressed from this chunk or -ve error code
+ */
+extern ssize_t lz4_stream_decode_update(lz4_stream_decode_state* state, const void* in_chunk, const size_t in_chunk_len);
+
+/**
+ * Complete a resumable decode once all of the block has been passed to lz4_stream_decode_update().
+ * @return size of decompressed data for the whole block or -ve error code
+ */
+extern ssize_t lz4_stream_decode_finish(lz4_stream_decode_state* state);
+
+/* Recommended ring buffer size for the bounded-memory decoder - 64KiB of history plus
+   64KiB of new output between slides. */
+#define LZ4_RING_DECODE_BUF_LEN (2*LZ4_WINDOW_SIZE)
+/* Space kept free after the history - the ring buffer must be at least
+   LZ4_WINDOW_SIZE + LZ4_RING_DECODE_MIN_ROOM bytes. */
+#define LZ4_RING_DECODE_MIN_ROOM (4*1024)
+
+/**
+ * State of a bounded-memory decode - see lz4_ring_decode_block().
+ */
+typedef struct lz4_ring_decode_state {
+  u8* buf;
+  u8* buf_limit;
+  // Next output position - the history_len bytes before it are the match window
+  u8* out;
+  size_t history_len;
+  // Total output so far
+  u64 total_len;
+  // Output before this has been hashed
+  u8* hashed;
+  // Content hash, or 0 to not hash
+  xxh32_state* hash;
+} lz4_ring_decode_state;
+
+/**
+ * Start a bounded-memory decode into buf_void, which is reused as a sliding window.
+ * Decoded data is only passed to hash (if not 0) and is then discarded, so this is
+ *   for verifying frames without keeping the content.
+ */
+extern void lz4_ring_decode_init(lz4_ring_decode_state* state, void* buf_void, const size_t buf_len, xxh32_state* hash);
+
+/**
+ * Set the match history for the next block - the prefix or dictionary for independent
+ *   blocks (0 length for none), or the dictionary at the start of a linked frame.
+ * Only the last LZ4_WINDOW_SIZE bytes are kept.
+ */
+extern void lz4_ring_decode_set_history(lz4_ring_decode_state* state, const void* history_void, const size_t history_len);
+
+/**
+ * Decode a compressed lz4 block through the ring buffer, hashing the output.
+ * Matches may reach back into the history of previous blocks - call
+ *   lz4_ring_decode_set_history() first for independent blocks.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_ring_decode_block(lz4_ring_decode_state* state, const void* in_void, const size_t in_len);
+
+/**
+ * Pass an uncompressed block through the ring buffer, hashing it and keeping it as history.
+ * @return in_len
+ */
+extern ssize_t lz4_ring_decode_raw(lz4_ring_decode_state* state, const void* in_void, const size_t in_len);
+
+/**
+ * Decompress a compressed lz4 block using vector loads and stores for literals and matches.
+ * Dispatches to the widest of the lz4_decode_block_simd_* variants supported by the CPU,
+ *   chosen once at startup, or lz4_decode_block_fast() if none is supported.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_simd(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+
+/**
+ * @return name of the variant chosen by lz4_decode_block_simd() - "avx512", "avx2", "sse2" or "fast"
+ */
+extern const char* lz4_decode_block_simd_name(void);
+
+/**
+ * Variants of lz4_decode_block_simd() for specific instruction sets.
+ * Only call these if the CPU supports the instruction set.
+ * @return size of decompressed data or -ve error code
+ */
+extern ssize_t lz4_decode_block_simd_sse2(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+extern ssize_t lz4_decode_block_simd_avx2(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+extern ssize_t lz4_decode_block_simd_avx512(void* out_void, const size_t out_len, const void* in_void, const size_t in_len);
+
+/*
+ * Sampled decoder statistics.
+ * The counters are only compiled into the decoders with -DLZ4_DECODE_STATS, and cover
+ *   the decoders in decode.c - lz4_decode_block_fast() and everything built on it - the
+ *   template decoders of decode-template.h, and the slow exact loop that all of them
+ *   finish with. Otherwise the functions below are still there, and the counters
+ *   stay 0.
+ * Counters are kept per thread, with no atomics - each thread takes snapshots of its
+ *   own, which can then be merged.
+ */
+
+/* Length histogram buckets - one per length, with the last for that length or more. */
+#define LZ4_STATS_LEN_BUCKETS 33
+/* Match offset histogram buckets - one per offset below 16, then one per power of 2. */
+#define LZ4_STATS_OFFSET_BUCKETS 28
+
+typedef struct lz4_decode_stats {
+  // Sequences decoded by sampled decoder loops
+  u64 sequences;
+
+  // Sampled sequences decoded by a fast loop, by how the sequence was copied:
+  // - short literals and match, in one speculative copy each
+  u64 fast_short;
+  // - long literals or match, with no overlap in the match copy
+  u64 fast_long;
+  // - an overlapping match, filled with its repeating pattern
+  u64 fast_overlap;
+  // - a match into an external dictionary, finished exactly
+  u64 fast_dict;
+  // Sampled sequences decoded by the exact slow loop
+  u64 slow;
+
+  // Times a fast loop bailed to the slow loop before the end of its input - all of
+  //   them rather than sampled, since they are rare
+  u64 bails;
+
+  // Sampled overlap fills by match offset - only offsets up to 15 are overlaps
+  u64 overlap_fill[16];
+
+  // Sampled sequence histograms - the last sequence of a block has literals only
+  u64 lits_len[LZ4_STATS_LEN_BUCKETS];
+  u64 match_len[LZ4_STATS_LEN_BUCKETS];
+  u64 match_offset[LZ4_STATS_OFFSET_BUCKETS];
+} lz4_decode_stats;
+
+/**
+ * @return 1 if the decoders were built with -DLZ4_DECODE_STATS, else 0
+ */
+extern int lz4_decode_stats_enabled(void);
+
+/**
+ * Sample 1 in every sample_rate calls of a decoder loop, on all threads - 1 (the
+ *   default) records everything, and 0 stops sampling.
+ * Every sequence of a sampled call is recorded. A call is typically a block - a fast
+ *   loop, or the slow loop for the tail of a block, which is sampled separately.
+ */
+extern void lz4_decode_stats_set_sample_rate(const u32 sample_rate);
+
+/**
+ * Copy the counters of the calling thread into snapshot.
+ */
+extern void lz4_decode_stats_snapshot(lz4_decode_stats* snapshot);
+
+/**
+ * Zero the counters of the calling thread.
+ */
+extern void lz4_decode_stats_reset(void);
+
+/**
+ * Add the counters of src into dst - typically snapshots from several threads.
+ */
+extern void lz4_decode_stats_merge(lz4_decode_stats* dst, const lz4_decode_stats* src);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,176 @@
+#ifndef LZ4_CACHE_H
+#define LZ4_CACHE_H
+
+// C++ only - shared cache of decoded blocks for random access readers.
+//
+// Blocks are keyed by (file id, block number) - file ids are handed out by the cache so
+//   that readers of different files can share it. The cache is split into shards, each
+//   with its own byte budget and least-recently-used eviction.
+//
+// Hits take no lock - each shard publishes an immutable snapshot of its map through a
+//   plain atomic pointer, and the map is replaced (copy-on-write) under the shard mutex
+//   when a block is added or evicted. Blocks are a few hundred microseconds to decode,
+//   and a cache holds at most a few thousand of them, so copying the map on a miss costs
+//   little beside the decode.
+// Replaced maps are freed RCU-style - readers announce themselves in one of two counters
+//   picked by the shard epoch, and the writer flips the epoch and waits for each counter
+//   to drain in turn before freeing the old map. Readers hold no more than a hash lookup.
+//
+// Misses are single-flight - the first thread to miss on a block decodes it outside the
+//   shard mutex, and other threads that want the same block meanwhile wait for it.
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "lz4-frame.h"
+#include "types.h"
+
+namespace Lz4 {
+
+  namespace Cache {
+
+    // A decoded block - immutable once in the cache, and kept alive by its users after
+    //   it is evicted. Its len bytes are all that is allocated, and what is charged
+    //   against the cache budget.
+    struct DecodedBlock {
+      std::unique_ptr<u8[]> data;
+      const size_t len;
+
+      DecodedBlock(const size_t len)
+	: data(new u8[len]), len(len) {}
+    };
+
+    typedef std::shared_ptr<const DecodedBlock> BlockPtr;
+
+    // Decode the block into all block->len bytes of block->data.
+    // @return Error::OK or the error
+    typedef std::function<Frame::Error(DecodedBlock* block)> DecodeFn;
+
+    struct Stats {
+      // Blocks found in the cache, decoded or being decoded by another thread
+      u64 hits;
+      // Of the hits, those that waited for another thread's decode
+      u64 waits;
+      u64 decodes;
+      u64 evictions;
+      // Currently cached
+      u64 blocks;
+      u64 bytes;
+    };
+
+    class BlockCache {
+      struct Key {
+	u64 file_id;
+	u64 block;
+
+	bool operator==(const Key& other) const {
+	  return file_id == other.file_id && block == other.block;
+	}
+      };
+
+      struct KeyHash {
+	size_t operator()(const Key& key) const {
+	  // Blocks of a file are spread over the shards
+	  return (size_t)((key.file_id * 0x9e3779b97f4a7c15ull) ^ key.block);
+	}
+      };
+
+      struct Result {
+	BlockPtr block;
+	Frame::Error error;
+      };
+
+      struct Entry {
+	// For threads that miss while the decode is in flight
+	std::shared_future<Result> result;
+	// The decoded block, once ready - set before ready under the shard mutex
+	BlockPtr block;
+	std::atomic<bool> ready;
+	// Shard tick of the last use - set on hits without the shard mutex
+	std::atomic<u64> last_used;
+
+	Entry(std::shared_future<Result> result, const u64 tick)
+	  : result(result), ready(false), last_used(tick) {}
+      };
+
+      typedef std::unordered_map<Key, std::shared_ptr<Entry>, KeyHash> Map;
+
+      // Cache line aligned so that shards do not share the hit path cache lines
+      struct alignas(64) Shard {
+	// Current snapshot - replaced under mutex, and freed once no reader can hold it
+	std::atomic<const Map*> map;
+	// Readers of the map, by the parity of the epoch they started in
+	std::atomic<u64> epoch;
+	std::atomic<u64> readers[2];
+	// Serialises replacing the map
+	std::mutex mutex;
+	std::atomic<u64> tick;
+	// Decoded bytes held - under mutex
+	size_t bytes;
+
+	std::atomic<u64> hits;
+	std::atomic<u64> waits;
+	std::atomic<u64> decodes;
+	std::atomic<u64> evictions;
+
+	Shard()
+	  : map(new Map()), epoch(0), readers{ {0}, {0} }, tick(0), bytes(0), hits(0), waits(0), decodes(0), evictions(0) {}
+
+	~Shard() { delete map.load(); }
+      };
+
+      const size_t shard_budget;
+      const size_t block_capacity;
+      const size_t n_shards;
+      std::unique_ptr<Shard[]> shards;
+      std::atomic<u64> next_file_id;
+
+      Shard& shard_for(const Key& key) { return shards[KeyHash()(key) % n_shards]; }
+
+      // Replace the shard's map and free the old one once no reader holds it. Under shard.mutex.
+      static void publish(Shard& shard, const Map* new_map);
+
+      // Mark the decoded entry ready, add its bytes to the shard and evict least recently
+      //   used blocks down to the budget, or remove the entry if its decode failed. Under
+      //   shard.mutex.
+      void settle(Shard& shard, const Key& key, Entry* entry, const Result& result);
+
+      // Take the result of entry, waiting for it if the decode is in flight.
+      static Frame::Error take(Shard& shard, Entry* entry, BlockPtr* out);
+
+    public:
+      // A cache of at most budget bytes of decoded blocks, sized for blocks of up to
+      //   block_max_bytes each.
+      // There are fewer than n_shards shards if budget would not hold a block per shard,
+      //   and a budget smaller than one block caches nothing.
+      BlockCache(const size_t budget, const size_t block_max_bytes, const size_t n_shards = 16);
+
+      BlockCache(const BlockCache&) = delete;
+      BlockCache& operator=(const BlockCache&) = delete;
+
+      // @return a new file id - one per file read through the cache
+      u64 add_file() { return next_file_id.fetch_add(1, std::memory_order_relaxed); }
+
+      // Look up block of file_id, decoding its decoded_len bytes with decode if it is not
+      //   cached. Thread-safe.
+      // Only one thread decodes a block at a time - others missing on it wait and share
+      //   its result, including any error. Failed decodes are not cached.
+      // @return Error::OK with *block set, or the error
+      Frame::Error get(const u64 file_id, const u64 block, const size_t decoded_len, const DecodeFn& decode, BlockPtr* out);
+
+      size_t block_max_bytes() const { return block_capacity; }
+
+      // Counters summed over the shards - not a consistent snapshot while in use.
+      Stats stats() const;
+    }; // class BlockCache
+
+  } // namespace Cache
+
+} // namespace Lz4
+
+#endif //ndef LZ4_CACHE_H
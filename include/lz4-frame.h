@@ -0,0 +1,383 @@
+#ifndef LZ4_FRAME_H
+#define LZ4_FRAME_H
+
+// C++ only - lz4 frame format and zero-copy frame and stream readers.
+//
+// Nothing here allocates or throws - errors are returned as Frame::Error codes. Blocks
+//   are returned as views into the caller's frame buffer, which must outlive them.
+//
+// Legacy frames (magic LZ4_LEGACY_MAGIC) are read as frames with independent 8MiB blocks
+//   and no checksums, so the same block loop handles both formats.
+
+#include <cstddef>
+
+#include "types.h"
+#include "xxhash32.h"
+
+namespace Lz4 {
+
+  // https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+  namespace Frame {
+
+    namespace Flg {
+      const u8 VERSION_SHIFT = 6;
+      const u8 BLOCK_INDEP_SHIFT = 5;
+      const u8 BLOCK_CHECKSUM_SHIFT = 4;
+      const u8 CONTENT_SIZE_SHIFT = 3;
+      const u8 CONTENT_CHECKSUM_SHIFT = 2;
+      const u8 RESERVED_1_SHIFT = 1;
+      const u8 DICT_ID_SHIFT = 0;
+
+      inline u8 version(const u8 flg) { return flg >> VERSION_SHIFT; }
+      const u8 VERSION_01 = 0x1;
+
+      const u8 BLOCK_INDEP_FLAG = 1 << BLOCK_INDEP_SHIFT;
+      const u8 BLOCK_CHECKSUM_FLAG = 1 << BLOCK_CHECKSUM_SHIFT;
+      const u8 CONTENT_SIZE_FLAG = 1 << CONTENT_SIZE_SHIFT;
+      const u8 CONTENT_CHECKSUM_FLAG = 1 << CONTENT_CHECKSUM_SHIFT;
+      const u8 RESERVED_1_FLAG = 1 << RESERVED_1_SHIFT;
+      const u8 DICT_ID_FLAG = 1 << DICT_ID_SHIFT;
+
+      inline bool flag_is_set(const u8 flags, const u8 flag) {
+	return (flags & flag) != 0;
+      }
+
+    } // namespace Flg
+
+    namespace Bd {
+      const u8 RESERVED_7_SHIFT = 7;
+
+      inline bool reserved_7(const u8 bd) { return (bd >> RESERVED_7_SHIFT) != 0; }
+
+      const u8 BLOCK_MAX_SIZE_SHIFT = 4;
+      const u8 BLOCK_MAX_SIZE_WIDTH = 3;
+      const u8 BLOCK_MAX_SIZE_MASK = (1 << BLOCK_MAX_SIZE_WIDTH) - 1;
+
+      inline u8 block_max_size(const u8 bd) { return (bd >> BLOCK_MAX_SIZE_SHIFT) & BLOCK_MAX_SIZE_MASK; }
+
+      const u8 BLOCK_MAX_SIZE_64KB = 4;
+      const u8 BLOCK_MAX_SIZE_4MB = 7;
+
+      // Not valid in a frame descriptor - stands for the fixed block size of legacy frames.
+      const u8 BLOCK_MAX_SIZE_LEGACY = 0;
+      const size_t BLOCK_MAX_BYTES_LEGACY = 8*1024*1024;
+
+      inline bool block_max_size_is_valid(const u8 bd) {
+	return BLOCK_MAX_SIZE_64KB <= block_max_size(bd) && block_max_size(bd) <= BLOCK_MAX_SIZE_4MB;
+      }
+
+      // 64KiB, 256KiB, 1MiB or 4MiB - or 8MiB for legacy frames
+      inline size_t block_max_bytes(const u8 bd) {
+	return block_max_size(bd) == BLOCK_MAX_SIZE_LEGACY ? BLOCK_MAX_BYTES_LEGACY : (size_t)1 << (8 + 2*block_max_size(bd));
+      }
+
+      const u8 RESERVED_3_2_1_0_SHIFT = 0;
+      const u8 RESERVED_3_2_1_0_WIDTH = 4;
+      const u8 RESERVED_3_2_1_0_MASK = (1 << RESERVED_3_2_1_0_WIDTH) - 1;
+
+      inline u8 reserved_3_2_1_0(const u8 bd) { return (bd >> RESERVED_3_2_1_0_SHIFT) & RESERVED_3_2_1_0_MASK; }
+
+    } // namespace Bd
+
+    struct Descriptor {
+      u8 flg;
+      u8 bd;
+
+      u64 content_size;
+
+      u32 dict_id;
+
+      u8 hc;
+
+      Descriptor()
+	: flg(0), bd(0), content_size(0), dict_id(0), hc(0) {}
+
+      Descriptor(const u8 flg, const u8 bd, const u64 content_size, const u32 dict_id, const u8 hc)
+	: flg(flg), bd(bd), content_size(content_size), dict_id(dict_id), hc(hc) {}
+
+      u8 flg_version() const {
+	return Flg::version(flg);
+      }
+
+      bool flg_is_set(const u8 flag) const {
+	return Flg::flag_is_set(flg, flag);
+      }
+
+      bool bd_reserved_7() const {
+	return Bd::reserved_7(bd);
+      }
+
+      u8 bd_block_max_size() const {
+	return Bd::block_max_size(bd);
+      }
+
+      size_t bd_block_max_bytes() const {
+	return Bd::block_max_bytes(bd);
+      }
+
+      u8 bd_reserved_3_2_1_0() const {
+	return Bd::reserved_3_2_1_0(bd);
+      }
+    };
+
+    const u32 LZ4_FRAME_MAGIC = 0x184d2204;
+
+    // Legacy frames are the magic number followed by blocks of a u32 compressed length
+    //   and always compressed data, each decoding to 8MiB except the last. There is no
+    //   endmark - the frame ends at the end of the input or at the next frame's magic
+    //   number, which is larger than any legacy block length.
+    const u32 LZ4_LEGACY_MAGIC = 0x184c2102;
+    // LZ4_COMPRESSBOUND() of an 8MiB block
+    const u32 LZ4_LEGACY_BLOCK_BOUND = Bd::BLOCK_MAX_BYTES_LEGACY + Bd::BLOCK_MAX_BYTES_LEGACY/255 + 16;
+
+    // Skippable frames have any of the 16 magic numbers 0x184d2a50 to 0x184d2a5f,
+    //   followed by a u32 length and that many bytes of user data.
+    const u32 LZ4_SKIPPABLE_MAGIC_BASE = 0x184d2a50;
+    const u32 LZ4_SKIPPABLE_MAGIC_MASK = 0xfffffff0;
+    const size_t LZ4_SKIPPABLE_HEADER_LEN = 2*sizeof(u32);
+
+    inline bool is_skippable_magic(const u32 magic) {
+      return (magic & LZ4_SKIPPABLE_MAGIC_MASK) == LZ4_SKIPPABLE_MAGIC_BASE;
+    }
+
+    struct Header {
+      size_t len;
+      u32 magic;
+      Descriptor descriptor;
+
+      Header()
+	: len(0), magic(0) {}
+
+      Header(size_t len, u32 magic, const u8 flg, const u8 bd, const u64 content_size, const u32 dict_id, const u8 hc)
+	: len(len), magic(magic), descriptor(Descriptor(flg, bd, content_size, dict_id, hc)) {}
+
+      bool is_legacy() const { return magic == LZ4_LEGACY_MAGIC; }
+    };
+
+    struct Trailer {
+      const u32 content_checksum;
+
+      Trailer(const u32 content_checksum)
+	: content_checksum(content_checksum) {}
+    };
+
+  } // namespace Frame
+
+  // https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+  namespace Block {
+
+    struct Header {
+      const u32 block_size;
+
+      Header(const u32 block_size)
+	: block_size(block_size) {}
+
+      bool is_endmark() const {
+	return block_size == 0;
+      }
+
+      bool is_compressed() const {
+	return (block_size & 0x80000000) == 0;
+      }
+
+      // Note - does not include the block checksum if present.
+      u32 data_length() const {
+	return block_size & 0x7fffffff;
+      }
+    };
+
+    struct Trailer {
+      const u32 block_checksum;
+
+      Trailer(const u32 block_checksum)
+	: block_checksum(block_checksum) {}
+    };
+
+  } // namespace Block
+
+  namespace Frame {
+
+    // Errors from parsing a frame.
+    enum class Error {
+      OK = 0,
+      HEADER_TOO_SHORT,
+      BAD_MAGIC,
+      BAD_VERSION,
+      RESERVED_FLG_BIT,
+      RESERVED_BD_BITS,
+      BAD_BLOCK_MAX_SIZE,
+      HEADER_CHECKSUM,
+      BLOCK_HEADER_TOO_SHORT,
+      // Block data runs past the end of the buffer
+      BLOCK_TOO_LONG,
+      // Block data is larger than the frame block max size
+      BLOCK_TOO_LARGE,
+      TRAILER_TOO_SHORT,
+      // Seek index - see lz4-index.h
+      INDEX_TOO_SHORT,
+      INDEX_BAD_MAGIC,
+      INDEX_CHECKSUM,
+      // The index does not describe this frame
+      INDEX_MISMATCH,
+      // Random access needs independent blocks
+      LINKED_BLOCKS,
+      BLOCK_CHECKSUM,
+      BLOCK_DECODE,
+      // Block cache is sized for smaller blocks than the frame block max size
+      CACHE_TOO_SMALL,
+      // Skippable frame data runs past the end of the buffer
+      SKIPPABLE_TOO_LONG,
+    };
+
+    // @return static description of error
+    const char* error_message(const Error error);
+
+    // Parse and check the frame header at the start of buf, including the header checksum.
+    // A legacy frame header is just the magic number - *header is given a descriptor for
+    //   independent blocks of Bd::BLOCK_MAX_BYTES_LEGACY with no checksums.
+    // @return Error::OK with *header set, or the error
+    Error parse_header(const u8* buf, const size_t buf_len, Header* header);
+
+    // A block of a frame - a view into the frame buffer, nothing is copied.
+    struct BlockView {
+      // Block data, not including the block checksum if present
+      const u8* data;
+      u32 len;
+      bool compressed;
+      // Block checksum, if the frame has them
+      bool has_checksum;
+      u32 checksum;
+
+      // @return true if there is no block checksum, or it matches the block data
+      bool checksum_ok() const {
+	return !has_checksum || xxh32(data, len, 0) == checksum;
+      }
+    };
+
+    // Steps through the blocks of a frame in a caller-owned buffer.
+    // A FrameReader is a few words of state - a copy carries on from the same block as
+    //   the original, and rewind() starts a reader at the first block again. Copies can
+    //   iterate from more than one thread.
+    //
+    //   Lz4::Frame::FrameReader reader;
+    //   if(reader.open(buf, buf_len) != Lz4::Frame::Error::OK) ...
+    //   Lz4::Frame::BlockView block;
+    //   while(reader.next(&block)) ...
+    //   if(reader.error() != Lz4::Frame::Error::OK) ...
+    class FrameReader {
+      Header frame_header;
+      size_t block_max_bytes;
+      size_t checksum_len;
+
+      const u8* frame_start;
+      // Next block header
+      const u8* pos;
+      bool legacy;
+      const u8* buf_limit;
+
+      Error last_error;
+      // Past the endmark and content checksum
+      bool at_end;
+      u32 trailer_content_checksum;
+
+      // next() for legacy frames
+      bool next_legacy(BlockView* block);
+
+    public:
+      FrameReader()
+	: block_max_bytes(0), checksum_len(0), frame_start(0), pos(0), legacy(false), buf_limit(0),
+	  last_error(Error::HEADER_TOO_SHORT), at_end(true), trailer_content_checksum(0) {}
+
+      // Start reading the frame at the start of buf - it may be followed by other data.
+      // @return Error::OK or the header error, which is also error()
+      Error open(const u8* buf, const size_t buf_len);
+
+      // Start again at the first block of the frame.
+      // @return Error::OK or the header error, as from open()
+      Error rewind() { return open(frame_start, buf_limit - frame_start); }
+
+      // Step to the next block.
+      // @return true with *block set, or false at the end of the frame or on error - see error()
+      bool next(BlockView* block);
+
+      // Error::OK unless open() or next() failed
+      Error error() const { return last_error; }
+
+      // True once next() has passed the endmark and content checksum
+      bool done() const { return at_end && last_error == Error::OK; }
+
+      const Header& header() const { return frame_header; }
+
+      const Descriptor& descriptor() const { return frame_header.descriptor; }
+
+      // Start of the frame header - the buf given to open()
+      const u8* start() const { return frame_start; }
+
+      // Length of the buffer from start() - the frame and whatever follows it
+      size_t buf_len() const { return buf_limit - frame_start; }
+
+      // Start of the block data - immediately after the frame header
+      const u8* blocks() const { return frame_start + frame_header.len; }
+
+      // Content checksum from the frame trailer, once done() - 0 if the frame has none
+      u32 content_checksum() const { return trailer_content_checksum; }
+
+      // Length of the whole frame including the trailer, once done()
+      size_t frame_len() const { return pos - frame_start; }
+    }; // class FrameReader
+
+    // Steps through the frames of a caller-owned buffer - lz4 frames and legacy frames one
+    //   after another, as the lz4 tools write them when frames are appended to a file.
+    //   Skippable frames are passed over without reading their data.
+    //
+    //   Lz4::Frame::StreamReader stream;
+    //   stream.open(buf, buf_len);
+    //   while(stream.next_frame()) {
+    //     while(stream.frame().next(&block)) ...
+    //   }
+    //   if(stream.error() != Lz4::Frame::Error::OK) ...
+    class StreamReader {
+      // Start of the current frame, or of the next one if not in_frame
+      const u8* pos;
+      const u8* buf_limit;
+      FrameReader current;
+      bool in_frame;
+
+      Error last_error;
+      size_t n_frames;
+      size_t n_skippable;
+
+    public:
+      StreamReader()
+	: pos(0), buf_limit(0), in_frame(false), last_error(Error::OK), n_frames(0), n_skippable(0) {}
+
+      void open(const u8* buf, const size_t buf_len) {
+	*this = StreamReader();
+	pos = buf;
+	buf_limit = buf + buf_len;
+      }
+
+      // Step to the next lz4 or legacy frame. Blocks of the current frame that have not
+      //   been read are passed over, reading only their headers.
+      // @return true with frame() open on the frame, or false at the end of the buffer or
+      //   on error - see error()
+      bool next_frame();
+
+      // The current frame - valid after next_frame() returns true
+      FrameReader& frame() { return current; }
+
+      // Error::OK unless a frame header or block, or a skippable frame, was bad - or the
+      //   buffer does not end with a whole frame
+      Error error() const { return last_error; }
+
+      // lz4 and legacy frames so far
+      size_t frames() const { return n_frames; }
+
+      size_t skippable_frames() const { return n_skippable; }
+    }; // class StreamReader
+
+  } // namespace Frame
+
+} // namespace Lz4
+
+#endif //ndef LZ4_FRAME_H
@@ -0,0 +1,140 @@
+#ifndef LZ4_INDEX_H
+#define LZ4_INDEX_H
+
+// C++ only - seek index of the blocks of an lz4 frame, for random access to the content.
+//
+// The index records where each block starts in the frame and in the content. It can be
+//   kept in a sidecar file, or appended to the frame as a skippable frame so that lz4
+//   tools still decode the file.
+//
+// Serialised index - all little-endian u32:
+//   n_blocks entries of { block length including header and checksum, decoded length }
+//   footer { n_blocks, xxh32 of the entries, LZ4_INDEX_MAGIC }
+// The skippable frame trailer is the usual skippable frame header followed by the
+//   serialised index, so it can be found from its footer at the end of the file.
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lz4-cache.h"
+#include "lz4-frame.h"
+#include "types.h"
+
+namespace Lz4 {
+
+  namespace Index {
+
+    // "LZ4X"
+    const u32 LZ4_INDEX_MAGIC = 0x58345a4c;
+    // Skippable frame magic of the index trailer
+    const u32 LZ4_INDEX_SKIPPABLE_MAGIC = Frame::LZ4_SKIPPABLE_MAGIC_BASE | 0xe;
+
+    const size_t ENTRY_LEN = 2*sizeof(u32);
+    const size_t FOOTER_LEN = 3*sizeof(u32);
+
+    struct BlockEntry {
+      // Offset of the block header from the first block, which follows the frame header
+      u64 blocks_offset;
+      // Offset of the decoded block in the content
+      u64 content_offset;
+      // Block header, data and checksum
+      u32 block_len;
+      u32 decoded_len;
+    };
+
+    class SeekIndex {
+      std::vector<BlockEntry> entries;
+      u64 total_content_len;
+
+      void add(const u32 block_len, const u32 decoded_len);
+
+    public:
+      SeekIndex()
+	: total_content_len(0) {}
+
+      // Index the frame of reader by walking its block headers from the first block,
+      //   however far reader has got. Compressed blocks are not decoded - their lengths
+      //   come from lz4_decode_block_len().
+      // @return Error::OK or the error
+      Frame::Error build(Frame::FrameReader reader);
+
+      // Load a serialised index - a sidecar file.
+      // @return Error::OK or the error
+      Frame::Error load(const u8* buf, const size_t buf_len);
+
+      // Load the index from a skippable frame trailer at the end of buf, if there is one.
+      // @return Error::OK, Error::INDEX_BAD_MAGIC if buf does not end with an index, or the error
+      Frame::Error load_trailer(const u8* buf, const size_t buf_len);
+
+      // Append the serialised index to out - a sidecar file.
+      void serialise(std::string& out) const;
+
+      // Append the index as a skippable frame to out, to go at the end of the file.
+      void serialise_trailer(std::string& out) const;
+
+      size_t n_blocks() const { return entries.size(); }
+
+      const BlockEntry& entry(const size_t block) const { return entries[block]; }
+
+      u64 content_len() const { return total_content_len; }
+
+      // @return the block holding content offset, or n_blocks() if offset is past the end
+      size_t find(const u64 offset) const;
+    }; // class SeekIndex
+
+    // Random access to the content of an independent-block frame through its seek index.
+    // Only the blocks overlapping a read are decoded - each of them whole, into the
+    //   caller's buffer or, for blocks only partly read, a scratch buffer. With a block
+    //   cache, compressed blocks are decoded into the cache instead and copied out of it.
+    // Not thread-safe because of the scratch buffer - use one reader per thread, sharing
+    //   the cache.
+    class SeekableReader {
+      // First block of the frame, and the length of the buffer from there
+      const u8* blocks;
+      size_t blocks_len;
+      Frame::Descriptor descriptor;
+      const SeekIndex* index;
+      const u8* dict;
+      size_t dict_len;
+      std::unique_ptr<u8[]> scratch;
+      Cache::BlockCache* cache;
+      u64 cache_file_id;
+
+      // Locate block in the frame and check it against the index - the block checksum is
+      //   not checked.
+      Frame::Error block_at(const BlockEntry& entry, Frame::BlockView* block) const;
+
+      // Check the checksum of compressed block and decode all of it into out.
+      Frame::Error decode_block(const BlockEntry& entry, const Frame::BlockView& block, u8* out, const size_t out_len) const;
+
+    public:
+      SeekableReader()
+	: blocks(0), blocks_len(0), index(0), dict(0), dict_len(0), cache(0), cache_file_id(0) {}
+
+      // Read the frame at the start of buf, which index describes, decoding with the
+      //   external dictionary if dict_len is not 0. The buffer, index and dictionary must
+      //   outlive the reader.
+      // @return Error::OK or the error
+      Frame::Error open(const u8* buf, const size_t buf_len, const SeekIndex* index, const u8* dict = 0, const size_t dict_len = 0);
+
+      // Decode compressed blocks through cache, as file_id from cache->add_file() - the
+      //   same for all readers of the frame. Call after open().
+      // @return Error::OK, or Error::CACHE_TOO_SMALL if the cache is sized for smaller
+      //   blocks than the frame's block max size
+      Frame::Error use_cache(Cache::BlockCache* cache, const u64 file_id);
+
+      // Read up to len bytes of content starting at offset into out, like pread() -
+      //   *read_len is less than len only at the end of the content.
+      // Block checksums are checked for the blocks that are decoded or copied - blocks
+      //   found in the cache were checked when they were decoded.
+      // @return Error::OK with *read_len set, or the error
+      Frame::Error pread_uncompressed(void* out, const size_t len, const u64 offset, size_t* read_len);
+    }; // class SeekableReader
+
+  } // namespace Index
+
+} // namespace Lz4
+
+#endif //ndef LZ4_INDEX_H
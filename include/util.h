@@ -35,7 +35,38 @@ void cpp_std_sort_suffixes(const u8* data, const u32 len, u32* suffix_indexes, u
   
 #ifdef __cplusplus
 namespace Util {
-  std::string slurp(const std::string& filepath);
+
+  // The contents of a file in memory, read-only - mapped where the file can be mapped,
+  //   else read with pread() (or read() for pipes and the like) into a buffer.
+  // Throws std::string if the file can not be opened or read.
+  class MappedFile {
+    const u8* buf;
+    size_t buf_len;
+    // True if buf is a mapping rather than read_buf
+    bool mapped;
+    std::string read_buf;
+
+  public:
+    // Access advice for the mapping - ignored where the platform does not have it.
+    // The file will be read through once, so read ahead and drop pages behind.
+    static const int SEQUENTIAL = 0x1;
+    // Start reading the whole file in now.
+    static const int WILLNEED = 0x2;
+    // Back the mapping with huge pages, where the kernel and file system can.
+    static const int HUGE_PAGES = 0x4;
+
+    MappedFile(const std::string& filepath, const int advice = SEQUENTIAL | WILLNEED);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const u8* data() const { return buf; }
+
+    size_t len() const { return buf_len; }
+
+    bool is_mapped() const { return mapped; }
+  }; // class MappedFile
 
   struct SuffixLess {
     const u8* data;
@@ -0,0 +1,45 @@
+#ifndef XXHASH32_H
+#define XXHASH32_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// xxHash32 - the checksum used by the lz4 frame format.
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+/*
+ * Streaming state - data can be fed in pieces of any size.
+ */
+typedef struct xxh32_state {
+  u32 acc[4];
+  // Total length fed so far
+  u64 total_len;
+  // Partial stripe carried over between updates
+  u8 stripe[16];
+  u32 stripe_len;
+  u32 seed;
+} xxh32_state;
+
+extern void xxh32_init(xxh32_state* state, const u32 seed);
+
+extern void xxh32_update(xxh32_state* state, const void* in_void, const size_t in_len);
+
+/**
+ * @return hash of all data fed so far - the state is not modified
+ */
+extern u32 xxh32_digest(const xxh32_state* state);
+
+/**
+ * One-shot hash.
+ * @return hash of in_len bytes at in_void
+ */
+extern u32 xxh32(const void* in_void, const size_t in_len, const u32 seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ndef XXHASH32_H
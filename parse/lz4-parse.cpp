@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -7,13 +9,28 @@
 #include <fstream>
 #include <iostream>
 #include <malloc.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <streambuf>
 #include <string>
 #include <sstream>
+#include <unordered_map>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "decode.h"
+#include "decode-template.h"
+#include "lz4-cache.h"
+#include "lz4-frame.h"
+#include "lz4-index.h"
 #include "util.h"
+#include "xxhash32.h"
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -30,231 +47,542 @@ const double ms_per_s = 1000.0;
   
 namespace Lz4 {
 
-  // https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
-  namespace Frame {
+  namespace Parse {
 
-    namespace Flg {
-      const u8 VERSION_SHIFT = 6;
-      const u8 BLOCK_INDEP_SHIFT = 5;
-      const u8 BLOCK_CHECKSUM_SHIFT = 4;
-      const u8 CONTENT_SIZE_SHIFT = 3;
-      const u8 CONTENT_CHECKSUM_SHIFT = 2;
-      const u8 RESERVED_1_SHIFT = 1;
-      const u8 DICT_ID_SHIFT = 0;
+    // The frame library reports errors as codes - here they are thrown.
+    void throw_if_error(const Frame::Error error) {
+      if(error != Frame::Error::OK) {
+	throw std::string(Frame::error_message(error));
+      }
+    }
 
-      const u8 version(const u8 flg) { return flg >> VERSION_SHIFT; }
-      const u8 VERSION_01 = 0x1;
+    // @return true with the next lz4 or legacy frame, or false at the end of the stream
+    bool next_frame(Frame::StreamReader& stream) {
+      if(stream.next_frame()) {
+	return true;
+      }
+      throw_if_error(stream.error());
+      return false;
+    }
 
-      const u8 BLOCK_INDEP_FLAG = 1 << BLOCK_INDEP_SHIFT;
-      const u8 BLOCK_CHECKSUM_FLAG = 1 << BLOCK_CHECKSUM_SHIFT;
-      const u8 CONTENT_SIZE_FLAG = 1 << CONTENT_SIZE_SHIFT;
-      const u8 CONTENT_CHECKSUM_FLAG = 1 << CONTENT_CHECKSUM_SHIFT;
-      const u8 RESERVED_1_FLAG = 1 << RESERVED_1_SHIFT;
-      const u8 DICT_ID_FLAG = 1 << DICT_ID_SHIFT;
+    // @return true with the next block, or false at the end of the frame
+    bool next_block(Frame::FrameReader& reader, Frame::BlockView* block) {
+      if(reader.next(block)) {
+	return true;
+      }
+      throw_if_error(reader.error());
+      return false;
+    }
 
-      bool flag_is_set(const u8 flags, const u8 flag) {
-	return (flags & flag) != 0;
+    void verify_block_checksum(const Frame::BlockView& block) {
+      if(!block.checksum_ok()) {
+	throw std::string("Block checksum mismatch");
       }
-      
-    } // namespace Flg
+    }
 
-    namespace Bd {
-      const u8 RESERVED_7_SHIFT = 7;
+    // Scan the block headers of a frame from the first block, without decoding anything.
+    // @return the blocks of the frame in order, not including the endmark
+    std::vector<Frame::BlockView> scan_blocks(Frame::FrameReader reader) {
+      std::vector<Frame::BlockView> blocks;
+      Frame::BlockView block;
 
-      bool reserved_7(const u8 bd) { return (bd >> RESERVED_7_SHIFT) != 0; }
-      
-      const u8 BLOCK_MAX_SIZE_SHIFT = 4;
-      const u8 BLOCK_MAX_SIZE_WIDTH = 3;
-      const u8 BLOCK_MAX_SIZE_MASK = (1 << BLOCK_MAX_SIZE_WIDTH) - 1;
+      reader.rewind();
 
-      u8 block_max_size(const u8 bd) { return (bd >> BLOCK_MAX_SIZE_SHIFT) & BLOCK_MAX_SIZE_MASK; }
+      while(next_block(reader, &block)) {
+	blocks.push_back(block);
+      }
 
-      const u8 RESERVED_3_2_1_0_SHIFT = 0;
-      const u8 RESERVED_3_2_1_0_WIDTH = 4;
-      const u8 RESERVED_3_2_1_0_MASK = (1 << RESERVED_3_2_1_0_WIDTH) - 1;
+      return blocks;
+    }
+  } // namespace Parse
 
-      u8 reserved_3_2_1_0(const u8 bd) { return (bd >> RESERVED_3_2_1_0_SHIFT) & RESERVED_3_2_1_0_MASK; }
-      
-    } // namespace Bd
+  namespace Dict {
 
-    struct Descriptor {
-      const u8 flg;
-      const u8 bd;
+    // An external dictionary - immutable once created so it can be shared between threads.
+    struct Dictionary {
+      const u32 dict_id;
+      // Only the last LZ4_WINDOW_SIZE bytes of a dictionary can be referenced by a match.
+      const std::string content;
 
-      const u64 content_size;
+      Dictionary(const u32 dict_id, const std::string& content)
+	: dict_id(dict_id),
+	  content(content.length() <= LZ4_WINDOW_SIZE ? content : content.substr(content.length() - LZ4_WINDOW_SIZE)) {}
 
-      const u32 dict_id;
+      const u8* data() const { return (const u8*)content.data(); }
 
-      const u8 hc;
+      size_t len() const { return content.length(); }
+    };
 
-      Descriptor(const u8 flg, const u8 bd, const u64 content_size, const u32 dict_id, const u8 hc)
-	: flg(flg), bd(bd), content_size(content_size), dict_id(dict_id), hc(hc) {}
+    // Dictionaries keyed by frame dict_id.
+    // Frames without a dict_id in the descriptor use the dictionary registered as NO_DICT_ID, if any.
+    // Thread-safe - dictionaries are loaded once, and lookups share the lock.
+    class Registry {
+      mutable std::shared_mutex mutex;
+      std::unordered_map<u32, std::shared_ptr<const Dictionary>> dicts;
 
-      u8 flg_version() const {
-	return Flg::version(flg);
-      }
-      
-      bool flg_is_set(const u8 flag) const {
-	return Flg::flag_is_set(flg, flag);
+    public:
+      static const u32 NO_DICT_ID = 0;
+
+      // Register a dictionary, unless one is already registered for dict_id.
+      // @return the registered dictionary for dict_id
+      std::shared_ptr<const Dictionary> add(const u32 dict_id, const std::string& content) {
+	std::unique_lock<std::shared_mutex> lock(mutex);
+
+	auto it = dicts.find(dict_id);
+	if(it != dicts.end()) {
+	  return it->second;
+	}
+
+	auto dict = std::make_shared<const Dictionary>(dict_id, content);
+	dicts.emplace(dict_id, dict);
+	return dict;
       }
 
-      bool bd_reserved_7() const {
-	return Bd::reserved_7(bd);
+      std::shared_ptr<const Dictionary> load(const u32 dict_id, const std::string& filepath) {
+	{
+	  std::shared_lock<std::shared_mutex> lock(mutex);
+
+	  auto it = dicts.find(dict_id);
+	  if(it != dicts.end()) {
+	    return it->second;
+	  }
+	}
+
+	// Only the tail of the file is kept, so do not copy the rest
+	Util::MappedFile file(filepath, Util::MappedFile::SEQUENTIAL);
+	size_t tail_len = std::min(file.len(), (size_t)LZ4_WINDOW_SIZE);
+	return add(dict_id, std::string((const char*)file.data() + file.len() - tail_len, tail_len));
       }
 
-      u8 bd_block_max_size() const {
-	return Bd::block_max_size(bd);
+      // @return dictionary or nullptr if not registered
+      std::shared_ptr<const Dictionary> find(const u32 dict_id) const {
+	std::shared_lock<std::shared_mutex> lock(mutex);
+
+	auto it = dicts.find(dict_id);
+	return it == dicts.end() ? nullptr : it->second;
       }
 
-      u8 bd_reserved_3_2_1_0() const {
-	return Bd::reserved_3_2_1_0(bd);
+      // @return dictionary for the frame or nullptr if none
+      std::shared_ptr<const Dictionary> find_for_frame(const Frame::Descriptor& descriptor) const {
+	std::shared_ptr<const Dictionary> dict = find(descriptor.flg_is_set(Frame::Flg::DICT_ID_FLAG) ? descriptor.dict_id : NO_DICT_ID);
+
+	if(!dict && descriptor.flg_is_set(Frame::Flg::DICT_ID_FLAG)) {
+	  throw std::string("No dictionary registered for lz4 frame dict-id");
+	}
+
+	return dict;
+      }
+    }; // class Registry
+
+  } // namespace Dict
+
+  namespace Decode {
+
+    // Decodes the blocks of a frame in order.
+    // For linked blocks the last (up to) LZ4_WINDOW_SIZE bytes of output are kept
+    //   immediately before the block output buffer as the prefix for the next block.
+    // Independent blocks without a dictionary use the decoder specialised for the frame
+    //   block max size and checks.
+    class FrameDecoder {
+      const Frame::Descriptor descriptor;
+      const bool linked;
+      const size_t block_max_bytes;
+      const Checks checks;
+
+      // Specialised decoder, or nullptr for linked blocks, a dictionary or legacy frames
+      lz4_decode_block_fn* const block_decoder;
+
+      // LZ4_WINDOW_SIZE of history followed by the block output
+      u8* const buf;
+
+      // Length of valid history immediately before block_out()
+      size_t history_len;
+
+      // External dictionary, if any - only used directly by independent blocks;
+      //   for linked blocks it seeds the history.
+      const std::shared_ptr<const Dict::Dictionary> dict;
+
+      // Running hash of the decoded content, if the frame has a content checksum
+      xxh32_state content_hash;
+
+    public:
+      FrameDecoder(const Frame::Descriptor& descriptor, std::shared_ptr<const Dict::Dictionary> dict = nullptr, const Checks checks = Checks::HARDENED)
+	: descriptor(descriptor),
+	  linked(!descriptor.flg_is_set(Frame::Flg::BLOCK_INDEP_FLAG)),
+	  block_max_bytes(descriptor.bd_block_max_bytes()),
+	  checks(checks),
+	  block_decoder(linked || dict ? nullptr : select_block_decoder(descriptor.bd_block_max_bytes(), checks)),
+	  buf(new u8[LZ4_WINDOW_SIZE + descriptor.bd_block_max_bytes()]),
+	  history_len(0),
+	  dict(dict) {
+	xxh32_init(&content_hash, 0);
+
+	if(linked && dict) {
+	  history_len = dict->len();
+	  memcpy(block_out() - history_len, dict->data(), history_len);
+	}
       }
-    };
 
-    const u32 LZ4_FRAME_MAGIC = 0x184d2204;
-    
-    struct Header {
-      const size_t len;
-      const u32 magic;
-      const Descriptor descriptor;
+      ~FrameDecoder() {
+	delete[] buf;
+      }
 
-      Header(size_t len, u32 magic, const u8 flg, const u8 bd, const u64 content_size, const u32 dict_id, const u8 hc)
-	: len(len), magic(magic), descriptor(Descriptor(flg, bd, content_size, dict_id, hc)) {}
-    };
+      FrameDecoder(const FrameDecoder&) = delete;
+      FrameDecoder& operator=(const FrameDecoder&) = delete;
 
-    struct Trailer {
-      const u32 content_checksum;
+      bool is_linked() const { return linked; }
 
-      Trailer(const u32 content_checksum)
-	: content_checksum(content_checksum) {}
-    };
-    
-  } // namespace Frame
+      bool has_dict() const { return (bool)dict; }
 
-  // https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
-  namespace Block {
+      bool has_content_checksum() const { return descriptor.flg_is_set(Frame::Flg::CONTENT_CHECKSUM_FLAG); }
 
-    struct Header {
-      const u32 block_size;
+      // Output buffer for the next block
+      u8* block_out() const { return buf + LZ4_WINDOW_SIZE; }
 
-      Header(const u32 block_size)
-	: block_size(block_size) {}
+      size_t block_out_len() const { return block_max_bytes; }
 
-      bool is_endmark() const {
-	return block_size == 0;
-      }
+      // History available to the next block
+      size_t prefix_len() const { return history_len; }
 
-      bool is_compressed() const {
-	return (block_size & 0x80000000) == 0;
+      // Decode a compressed block into out with the history or dictionary of the next block,
+      //   without advancing the frame.
+      // @return decoded length or -ve error code
+      ssize_t decode_compressed(void* out, size_t out_len, const void* in, size_t in_len) const {
+	if(block_decoder) {
+	  return block_decoder(out, out_len, in, in_len);
+	}
+	if(!linked && dict) {
+	  return lz4_decode_block_with_dict(out, out_len, in, in_len, dict->data(), dict->len());
+	}
+	return lz4_decode_block_with_prefix(out, out_len, in, in_len, history_len);
       }
 
-      // Note - does not include the block checksum if present.
-      u32 data_length() const {
-	return block_size & 0x7fffffff;
+      // As decode_compressed(), feeding the output to state as it goes.
+      // @return decoded length or -ve error code
+      ssize_t decode_compressed_hash(void* out, size_t out_len, const void* in, size_t in_len, xxh32_state* state) const {
+	if(!linked && dict) {
+	  return lz4_decode_block_with_dict_hash(out, out_len, in, in_len, dict->data(), dict->len(), state);
+	}
+	return lz4_decode_block_with_prefix_hash(out, out_len, in, in_len, history_len, state);
       }
-    };
 
-    struct Trailer {
-      const u32 block_checksum;
+      // Decode the next block of the frame into block_out(), verifying the block checksum
+      //   and accumulating the content checksum if the frame has them.
+      // @return decoded length
+      size_t decode_block(const Frame::BlockView& block) {
+	const u8* block_data = block.data;
+	const u32 data_len = block.len;
+	size_t raw_len;
+
+	Parse::verify_block_checksum(block);
+
+	if(block.compressed) {
+	  // The hashing decoders are all hardened - trusted input is decoded by the
+	  //   specialised decoder and hashed after.
+	  const bool fused_hash = has_content_checksum() && !(block_decoder && checks == Checks::TRUSTED);
+	  ssize_t rc = fused_hash
+	    ? decode_compressed_hash(block_out(), block_out_len(), block_data, data_len, &content_hash)
+	    : decode_compressed(block_out(), block_out_len(), block_data, data_len);
+	  if(rc < 0) {
+	    throw std::string("Block decode failed");
+	  }
+	  raw_len = (size_t)rc;
 
-      Trailer(const u32 block_checksum)
-	: block_checksum(block_checksum) {}
-    };
-    
-  } // namespace Block
-  
-  namespace Parse {
+	  if(has_content_checksum() && !fused_hash) {
+	    xxh32_update(&content_hash, block_out(), raw_len);
+	  }
+	} else {
+	  if(data_len > block_out_len()) {
+	    throw std::string("Uncompressed block is larger than block max size");
+	  }
+	  memcpy(block_out(), block_data, data_len);
+	  raw_len = data_len;
 
-    Frame::Header parse_header(const u8* buf, size_t buf_len) {
-      
-      const int min_header_len = sizeof(Frame::Header::magic) + sizeof(Frame::Descriptor::flg)
-	+ sizeof(Frame::Descriptor::bd) + sizeof(Frame::Descriptor::hc);
-      
-      if(buf_len < min_header_len) {
-	throw std::string("Input buffer too short for minimum lz4 frame header");
-      }
+	  if(has_content_checksum()) {
+	    xxh32_update(&content_hash, block_out(), raw_len);
+	  }
+	}
 
-      size_t header_len = min_header_len;
-	 
-      const u32 magic = u32_at_offset(buf, 0);
+	if(linked) {
+	  // Slide the window so that it ends at block_out() again
+	  size_t new_history_len = std::min((size_t)LZ4_WINDOW_SIZE, history_len + raw_len);
+	  u8* window_end = block_out() + raw_len;
+	  memmove(block_out() - new_history_len, window_end - new_history_len, new_history_len);
+	  history_len = new_history_len;
+	}
 
-      if(magic != Frame::LZ4_FRAME_MAGIC) {
-	throw std::string("Invalid lz frame magic number");
+	return raw_len;
       }
 
-      buf += sizeof(Frame::Header::magic);
+      // Check the content checksum at the end of the frame against all blocks decoded so far.
+      void verify_content_checksum(const u32 content_checksum) const {
+	if(xxh32_digest(&content_hash) != content_checksum) {
+	  throw std::string("Content checksum mismatch");
+	}
+      }
+    }; // class FrameDecoder
+
+    // Decodes all of the blocks of an independent-block frame concurrently.
+    // Block i is decoded at offset i*block_max_bytes of the output buffer, which is its
+    //   final position unless an earlier block (other than the last) is short - in that
+    //   case the output is compacted once all blocks are decoded.
+    class ParallelFrameDecoder {
+      const Frame::Descriptor descriptor;
+      const size_t block_max_bytes;
+
+      // Specialised for the frame block max size and how far the input is trusted - or
+      //   the generic decoder for legacy frames, whose compressed blocks can be larger
+      //   than the block max size.
+      lz4_decode_block_fn* block_decoder;
+
+      // External dictionary, if any - read-only so shared by all workers.
+      const std::shared_ptr<const Dict::Dictionary> dict;
+
+      // Decoder statistics merged from the workers, if built with -DLZ4_DECODE_STATS
+      mutable std::mutex stats_mutex;
+      mutable lz4_decode_stats stats_total = {};
+
+      // decode_one() error for a block checksum mismatch - clear of the decoder error codes
+      static const ssize_t ERR_BLOCK_CHECKSUM = -1000;
+
+      // Runs on the worker threads so must not throw.
+      // @return decoded length, -ve decoder error code or ERR_BLOCK_CHECKSUM
+      ssize_t decode_one(const Frame::BlockView& block, u8* out) const {
+	const u32 data_len = block.len;
+
+	if(!block.checksum_ok()) {
+	  return ERR_BLOCK_CHECKSUM;
+	}
 
-      const u8 flg = *buf++;
+	if(!block.compressed) {
+	  if(data_len > block_max_bytes) {
+	    return -LZ4_DECODE_ERR_OUTPUT_OVERFLOW;
+	  }
+	  memcpy(out, block.data, data_len);
+	  return data_len;
+	}
 
-      if(Frame::Flg::version(flg) != Frame::Flg::VERSION_01) {
-	throw std::string("Unrecognized lz4 frame version number");
+	if(dict) {
+	  return lz4_decode_block_with_dict(out, block_max_bytes, block.data, data_len, dict->data(), dict->len());
+	}
+	return block_decoder(out, block_max_bytes, block.data, data_len);
       }
 
-      if(Frame::Flg::flag_is_set(flg, Frame::Flg::RESERVED_1_FLAG)) {
-      	throw std::string("Reserved bit 1 in lz4 flg field is not 0");
+    public:
+      ParallelFrameDecoder(const Frame::Descriptor& descriptor, std::shared_ptr<const Dict::Dictionary> dict = nullptr, const Checks checks = Checks::HARDENED)
+	: descriptor(descriptor),
+	  block_max_bytes(descriptor.bd_block_max_bytes()),
+	  block_decoder(select_block_decoder(descriptor.bd_block_max_bytes(), checks)),
+	  dict(dict) {
+	if(!descriptor.flg_is_set(Frame::Flg::BLOCK_INDEP_FLAG)) {
+	  throw std::string("Parallel decode needs a frame with independent blocks");
+	}
+	if(!block_decoder) {
+	  block_decoder = lz4_decode_block_fast;
+	}
       }
-      
-      const u8 bd = *buf++;
 
-      if(Frame::Bd::reserved_7(bd) != 0) {
-	throw std::string("Reserved bit 7 in lz4 bd field is not 0");
+      // Output buffer length needed to decode blocks.
+      size_t out_len(const std::vector<Frame::BlockView>& blocks) const {
+	return blocks.size() * block_max_bytes;
       }
 
-      if(Frame::Bd::reserved_3_2_1_0(bd) != 0) {
-	throw std::string("Reserved bits 3-0 in lz4 bd field are not 0");
+      // Decoder statistics of all decode() calls so far, if built with -DLZ4_DECODE_STATS.
+      lz4_decode_stats stats() const {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	return stats_total;
       }
 
-      // TODO - validate block_max_size
+      // Decode blocks into out, which must be at least out_len(blocks) long, with
+      //   n_threads threads including the calling thread.
+      // With decoder statistics, the counters of the calling thread are reset.
+      // @return decoded length of the frame
+      size_t decode(const std::vector<Frame::BlockView>& blocks, u8* out, unsigned n_threads) const {
+	const size_t n_blocks = blocks.size();
+	std::vector<ssize_t> raw_lens(n_blocks);
+
+	// Blocks are handed out one at a time in order, so a slow block does not hold up
+	//   a fixed partition.
+	std::atomic<size_t> next_block(0);
+	std::atomic<bool> failed(false);
 
-      u32 content_size = 0;
+	const bool collect_stats = lz4_decode_stats_enabled();
 
-      if(Frame::Flg::flag_is_set(flg, Frame::Flg::CONTENT_SIZE_FLAG)) {
-	header_len += sizeof(Frame::Descriptor::content_size);
+	auto worker = [&]() {
+	  if(collect_stats) {
+	    lz4_decode_stats_reset();
+	  }
+
+	  for(;;) {
+	    size_t i = next_block.fetch_add(1, std::memory_order_relaxed);
+	    if(i >= n_blocks || failed.load(std::memory_order_relaxed)) {
+	      break;
+	    }
+	    raw_lens[i] = decode_one(blocks[i], out + i*block_max_bytes);
+	    if(raw_lens[i] < 0) {
+	      failed.store(true, std::memory_order_relaxed);
+	    }
+	  }
+
+	  if(collect_stats) {
+	    lz4_decode_stats snapshot;
+	    lz4_decode_stats_snapshot(&snapshot);
+	    std::lock_guard<std::mutex> lock(stats_mutex);
+	    lz4_decode_stats_merge(&stats_total, &snapshot);
+	  }
+	};
 
-	if(buf_len < header_len) {
-	  throw std::string("Input buffer too short for lz4 frame header with content size present");
+	std::vector<std::thread> threads;
+	for(unsigned t = 1; t < n_threads && t < n_blocks; t++) {
+	  threads.emplace_back(worker);
+	}
+	worker();
+	for(auto& thread : threads) {
+	  thread.join();
+	}
+
+	if(failed) {
+	  // Report the first failed block
+	  for(size_t i = 0; i < n_blocks; i++) {
+	    if(raw_lens[i] == ERR_BLOCK_CHECKSUM) {
+	      throw std::string("Block checksum mismatch");
+	    }
+	    if(raw_lens[i] < 0) {
+	      break;
+	    }
+	  }
+	  throw std::string("Block decode failed");
 	}
 
-	content_size = u64_at_offset(buf, 0);
+	// Close up the gaps left by short blocks.
+	size_t out_pos = 0;
+	for(size_t i = 0; i < n_blocks; i++) {
+	  size_t raw_len = (size_t)raw_lens[i];
+	  if(out_pos != i*block_max_bytes) {
+	    memmove(out + out_pos, out + i*block_max_bytes, raw_len);
+	  }
+	  out_pos += raw_len;
+	}
 
-	buf += sizeof(Frame::Descriptor::content_size);
+	return out_pos;
+      }
+    }; // class ParallelFrameDecoder
+
+    // Output of a whole frame in a memory mapping rather than a heap buffer, so that
+    //   blocks are decoded straight into their final place - a destination file mapped
+    //   shared, or an anonymous mapping if there is no file.
+    // Where the platform has them the mapping is asked for huge pages, which cut TLB
+    //   misses over multi-GiB outputs, and is prefaulted so that decode takes no page faults.
+    class MappedOutput {
+      // Output file, empty for anonymous memory
+      std::string path;
+      int fd;
+      u8* map;
+      size_t map_len;
+      // Set by truncate() once the output is whole
+      bool complete;
+
+      // Close and remove the output file, which is incomplete.
+      void remove_file() {
+	close(fd);
+	fd = -1;
+	unlink(path.c_str());
       }
 
-      u32 dict_id = 0;
-      
-      if(Frame::Flg::flag_is_set(flg, Frame::Flg::DICT_ID_FLAG)) {
-	header_len += sizeof(Frame::Descriptor::dict_id);
+      // Fault in every page of the mapping by writing to it - where it could not be
+      //   prefaulted in one go.
+      void touch_pages() {
+	const size_t page_len = (size_t)sysconf(_SC_PAGESIZE);
+	for(size_t off = 0; off < map_len; off += page_len) {
+	  ((volatile u8*)map)[off] = 0;
+	}
+      }
 
-	if(buf_len < header_len) {
-	  throw std::string("Input buffer too short for lz4 frame header with dictionary ID present");
+    public:
+      // Map len bytes of filepath, which is created or truncated - or anonymous memory if filepath is 0.
+      // The file is removed again unless truncate() is called - the output is incomplete
+      //   if decoding fails.
+      MappedOutput(const char* filepath, const size_t len)
+	: path(filepath ? filepath : ""), fd(-1), map(0), map_len(len), complete(false) {
+	if(filepath) {
+	  fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	  if(fd < 0) {
+	    throw std::string("Cannot open output file ") + filepath + ": " + strerror(errno);
+	  }
+	  if(ftruncate(fd, len) != 0) {
+	    int err = errno;
+	    remove_file();
+	    throw std::string("Cannot size output file ") + filepath + ": " + strerror(err);
+	  }
 	}
 
-	dict_id = u32_at_offset(buf, 0);
+	// mmap() of 0 bytes fails
+	if(map_len == 0) {
+	  return;
+	}
 
-	buf += sizeof(Frame::Descriptor::dict_id);
+	int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+#if defined(MAP_POPULATE) && !defined(MADV_POPULATE_WRITE)
+	// Prefault at map time, which is before MADV_HUGEPAGE can be applied
+	flags |= MAP_POPULATE;
+#endif
+
+	void* p = mmap(0, map_len, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if(p == MAP_FAILED) {
+	  int err = errno;
+	  if(fd >= 0) {
+	    remove_file();
+	  }
+	  throw std::string("Cannot map output: ") + strerror(err);
+	}
+	map = (u8*)p;
+
+#ifdef MADV_HUGEPAGE
+	// Only advice - it fails harmlessly where the kernel or file system has no huge pages.
+	madvise(map, map_len, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+	// Prefault for write once huge pages are asked for, so that the faults can take them.
+	//   Kernels before 5.14 fail this with EINVAL even when the headers have it.
+	if(madvise(map, map_len, MADV_POPULATE_WRITE) != 0) {
+	  touch_pages();
+	}
+#endif
+      }
+
+      ~MappedOutput() {
+	if(map) {
+	  munmap(map, map_len);
+	}
+	if(fd >= 0) {
+	  if(complete) {
+	    close(fd);
+	  } else {
+	    remove_file();
+	  }
+	}
       }
-      
-      const u8 hc = *buf++;
 
-      // TODO validate header checksum (hc)
+      MappedOutput(const MappedOutput&) = delete;
+      MappedOutput& operator=(const MappedOutput&) = delete;
 
-      return Frame::Header(header_len, magic, flg, bd, content_size, dict_id, hc);
-      
-    }
+      u8* data() const { return map; }
 
-    //template <typename BlockFn> 
-    Block::Header parse_block_header(const u8* buf, size_t buf_len) {
-      const int min_header_len = sizeof(Block::Header::block_size);
-      
-      if(buf_len < min_header_len) {
-	throw std::string("Input buffer too short for minimum lz4 block header");
+      size_t len() const { return map_len; }
+
+      bool is_file() const { return fd >= 0; }
+
+      // The output is whole - trim the file to the decoded length, if the mapping was
+      //   sized by a bound, and keep it.
+      void truncate(const size_t len) {
+	if(fd >= 0 && len != map_len && ftruncate(fd, len) != 0) {
+	  throw std::string("Cannot truncate output file: ") + strerror(errno);
+	}
+	complete = true;
       }
+    }; // class MappedOutput
 
-      const u32 block_size = u32_at_offset(buf, 0);
-      
-      return Block::Header(block_size);
-    }
-  } // namespace Parse
+  } // namespace Decode
   
 } // namespace Lz4
 
@@ -334,19 +662,646 @@ void show_sequences(const u8* buf, size_t block_len) {
   }
 }
 
+// Decode a block as if it were arriving from the network in chunk_len pieces.
+// @return decoded length or -ve error code
+ssize_t stream_decode_block(void* out, size_t out_len, const u8* in, size_t in_len, size_t prefix_len, size_t chunk_len) {
+  lz4_stream_decode_state state;
+  lz4_stream_decode_init(&state, out, out_len, prefix_len);
+
+  while(in_len > 0) {
+    size_t len = std::min(in_len, chunk_len);
+    ssize_t rc = lz4_stream_decode_update(&state, in, len);
+    if(rc < 0) {
+      return rc;
+    }
+    in += len;
+    in_len -= len;
+  }
+
+  return lz4_stream_decode_finish(&state);
+}
+
+// Print sampled decoder statistics - in the same form as the histograms that
+//   util.sh makes from show_sequence() output.
+void print_decode_stats(const char* desc, const lz4_decode_stats& stats) {
+  printf("  decoder stats - %s: %lu sequences sampled\n", desc, stats.sequences);
+  if(stats.sequences == 0) {
+    return;
+  }
+
+  printf("    fast-short %lu fast-long %lu fast-overlap %lu fast-dict %lu slow %lu - bails %lu\n",
+	 stats.fast_short, stats.fast_long, stats.fast_overlap, stats.fast_dict, stats.slow, stats.bails);
+
+  printf("    overlap fill by offset:");
+  for(size_t offset = 1; offset < 16; offset++) {
+    printf(" %zu:%lu", offset, stats.overlap_fill[offset]);
+  }
+  printf("\n");
+
+  auto print_hist = [&stats](const char* what, const u64* hist, size_t n_buckets, auto bucket_desc) {
+    u64 total = 0;
+    for(size_t i = 0; i < n_buckets; i++) {
+      total += hist[i];
+    }
+    u64 accum = 0;
+    for(size_t i = 0; i < n_buckets; i++) {
+      if(hist[i] != 0) {
+	accum += hist[i];
+	printf("    %-9s %-11s count %10lu %.4f accum %.4f\n", what, bucket_desc(i).c_str(), hist[i], (double)hist[i]/total, (double)accum/total);
+      }
+    }
+  };
+
+  auto len_desc = [](size_t i) {
+    return std::to_string(i) + (i == LZ4_STATS_LEN_BUCKETS - 1 ? "+" : "");
+  };
+  auto offset_desc = [](size_t i) {
+    if(i < 16) {
+      return std::to_string(i);
+    }
+    size_t lo = (size_t)1 << (i - 12);
+    return std::to_string(lo) + "-" + std::to_string(2*lo - 1);
+  };
+
+  print_hist("lits len", stats.lits_len, LZ4_STATS_LEN_BUCKETS, len_desc);
+  print_hist("match len", stats.match_len, LZ4_STATS_LEN_BUCKETS, len_desc);
+  print_hist("offset", stats.match_offset, LZ4_STATS_OFFSET_BUCKETS, offset_desc);
+}
+
+// Warm up and then time repeated decode of a block.
+// @return decoded length from the warm-up decode or -ve error code
+template <typename DecodeFn>
+ssize_t time_decode(const char* desc, DecodeFn decode_fn, u8* out_buf, size_t out_buf_len, const u8* buf, size_t buf_len) {
+  // Warm up decode
+  ssize_t raw_len = decode_fn(out_buf, out_buf_len, buf, buf_len);
+
+  if(raw_len < 0) {
+    printf("    %-8s decode failed with error %ld\n", desc, raw_len);
+    return raw_len;
+  }
+
+  // Time decode
+  auto t0 = Time::now();
+
+  const unsigned n_iters = 256;
+  for(unsigned i = 0; i < n_iters; i++) {
+    ssize_t raw_len2 = decode_fn(out_buf, out_buf_len, buf, buf_len);
+    if(raw_len2 != raw_len) {
+      printf("                      abort bad raw len %ld expecting %ld\n", raw_len2, raw_len);
+      break;
+    }
+  }
+  auto t1 = Time::now();
+  dsec ds1 = t1 - t0;
+  double secs1 = ds1.count();
+
+  double ms = secs1 * ms_per_s;
+  size_t copy_len = (size_t)raw_len;
+  double mib_per_s = copy_len*n_iters/MiB / secs1;
+
+  printf("    %-8s decompressed %zu bytes %u times in %9.3lfms - %10.3lfMiB/s\n", desc, copy_len, n_iters, ms, mib_per_s);
+
+  return raw_len;
+}
+
+// Warm up and then time repeated parallel decode of a whole frame.
+void time_parallel_decode(const Lz4::Decode::ParallelFrameDecoder& decoder, const std::vector<Lz4::Frame::BlockView>& blocks, u8* out, unsigned n_threads) {
+  // Warm up decode - also faults in the output buffer
+  size_t raw_len = decoder.decode(blocks, out, n_threads);
+
+  auto t0 = Time::now();
+
+  const unsigned n_iters = 16;
+  for(unsigned i = 0; i < n_iters; i++) {
+    decoder.decode(blocks, out, n_threads);
+  }
+  auto t1 = Time::now();
+  dsec ds1 = t1 - t0;
+  double secs1 = ds1.count();
+
+  double ms = secs1 * ms_per_s;
+  double mib_per_s = raw_len*n_iters/MiB / secs1;
+
+  printf("  parallel decode %zu blocks with %2u threads: %zu bytes %u times in %9.3lfms - %10.3lfMiB/s\n", blocks.size(), n_threads, raw_len, n_iters, ms, mib_per_s);
+}
+
+// Warm up and then time repeated decode of the compressed blocks of an independent-block
+//   frame on one core, n_interleave blocks at a time in lockstep.
+void time_interleaved_decode(const std::vector<Lz4::Frame::BlockView>& blocks, size_t block_max_bytes, u8* out, size_t n_interleave) {
+  std::vector<void*> outs;
+  std::vector<size_t> out_lens;
+  std::vector<const void*> ins;
+  std::vector<size_t> in_lens;
+
+  for(size_t i = 0; i < blocks.size(); i++) {
+    if(blocks[i].compressed) {
+      outs.push_back(out + i*block_max_bytes);
+      out_lens.push_back(block_max_bytes);
+      ins.push_back(blocks[i].data);
+      in_lens.push_back(blocks[i].len);
+    }
+  }
+
+  const size_t n_blocks = outs.size();
+  if(n_blocks == 0) {
+    return;
+  }
+
+  std::vector<ssize_t> results(n_blocks);
+
+  auto decode_all = [&]() {
+    for(size_t i = 0; i < n_blocks; i += n_interleave) {
+      size_t n = std::min(n_interleave, n_blocks - i);
+      if(lz4_decode_blocks_interleaved(n, &outs[i], &out_lens[i], &ins[i], &in_lens[i], &results[i]) < 0) {
+	throw std::string("Block decode failed");
+      }
+    }
+  };
+
+  // Warm up decode
+  decode_all();
+
+  size_t raw_len = 0;
+  for(ssize_t result : results) {
+    raw_len += result;
+  }
+
+  auto t0 = Time::now();
+
+  const unsigned n_iters = 16;
+  for(unsigned i = 0; i < n_iters; i++) {
+    decode_all();
+  }
+  auto t1 = Time::now();
+  dsec ds1 = t1 - t0;
+  double secs1 = ds1.count();
+
+  double ms = secs1 * ms_per_s;
+  double mib_per_s = raw_len*n_iters/MiB / secs1;
+
+  printf("  interleaved decode %zu blocks %zu at a time: %zu bytes %u times in %9.3lfms - %10.3lfMiB/s\n", n_blocks, n_interleave, raw_len, n_iters, ms, mib_per_s);
+}
+
+// Warm up and then time repeated decode of the compressed blocks of an independent-block
+//   frame on one core, all in one lz4_decode_blocks_batch() call.
+void time_batch_decode(const std::vector<Lz4::Frame::BlockView>& blocks, size_t block_max_bytes, u8* out, size_t n_interleave) {
+  std::vector<lz4_block_desc> descs;
+
+  for(size_t i = 0; i < blocks.size(); i++) {
+    if(blocks[i].compressed) {
+      descs.push_back(lz4_block_desc{ out + i*block_max_bytes, block_max_bytes, blocks[i].data, blocks[i].len });
+    }
+  }
+
+  const size_t n_blocks = descs.size();
+  if(n_blocks == 0) {
+    return;
+  }
+
+  std::vector<ssize_t> results(n_blocks);
+
+  auto decode_all = [&]() {
+    if(lz4_decode_blocks_batch(descs.data(), n_blocks, n_interleave, results.data()) < 0) {
+      throw std::string("Block decode failed");
+    }
+  };
+
+  // Warm up decode
+  decode_all();
+
+  size_t raw_len = 0;
+  for(ssize_t result : results) {
+    raw_len += result;
+  }
+
+  auto t0 = Time::now();
+
+  const unsigned n_iters = 16;
+  for(unsigned i = 0; i < n_iters; i++) {
+    decode_all();
+  }
+  auto t1 = Time::now();
+  dsec ds1 = t1 - t0;
+  double secs1 = ds1.count();
+
+  double ms = secs1 * ms_per_s;
+  double mib_per_s = raw_len*n_iters/MiB / secs1;
+
+  printf("  batch decode %zu blocks %zu at a time: %zu bytes %u times in %9.3lfms - %10.3lfMiB/s\n", n_blocks, n_interleave, raw_len, n_iters, ms, mib_per_s);
+}
+
+// Verify a frame like lz4 -t - decode it through a small ring buffer, checking the
+//   checksums and content size without keeping the content.
+// @return content length
+u64 verify_frame(Lz4::Frame::FrameReader& reader, std::shared_ptr<const Lz4::Dict::Dictionary> dict) {
+  const Lz4::Frame::Descriptor& descriptor = reader.descriptor();
+  const bool linked = !descriptor.flg_is_set(Lz4::Frame::Flg::BLOCK_INDEP_FLAG);
+
+  std::unique_ptr<u8[]> ring(new u8[LZ4_RING_DECODE_BUF_LEN]);
+
+  xxh32_state content_hash;
+  xxh32_init(&content_hash, 0);
+
+  lz4_ring_decode_state state;
+  lz4_ring_decode_init(&state, ring.get(), LZ4_RING_DECODE_BUF_LEN, &content_hash);
+
+  if(linked && dict) {
+    lz4_ring_decode_set_history(&state, dict->data(), dict->len());
+  }
+
+  u64 content_len = 0;
+  Lz4::Frame::BlockView block;
+
+  while(Lz4::Parse::next_block(reader, &block)) {
+    Lz4::Parse::verify_block_checksum(block);
+
+    if(!linked) {
+      lz4_ring_decode_set_history(&state, dict ? dict->data() : 0, dict ? dict->len() : 0);
+    }
+
+    ssize_t raw_len = block.compressed
+      ? lz4_ring_decode_block(&state, block.data, block.len)
+      : lz4_ring_decode_raw(&state, block.data, block.len);
+
+    if(raw_len < 0) {
+      throw std::string("Block decode failed");
+    }
+
+    if((size_t)raw_len > descriptor.bd_block_max_bytes()) {
+      throw std::string("Block decodes to more than block max size");
+    }
+
+    content_len += raw_len;
+  }
+
+  if(descriptor.flg_is_set(Lz4::Frame::Flg::CONTENT_CHECKSUM_FLAG) && xxh32_digest(&content_hash) != reader.content_checksum()) {
+    throw std::string("Content checksum mismatch");
+  }
+
+  if(descriptor.flg_is_set(Lz4::Frame::Flg::CONTENT_SIZE_FLAG) && content_len != descriptor.content_size) {
+    throw std::string("Content size mismatch");
+  }
+
+  return content_len;
+}
+
+// Verify every frame from the current frame of stream to the end, each with its own
+//   dictionary.
+// @return content length
+u64 verify_stream(Lz4::Frame::StreamReader& stream, const Lz4::Dict::Registry& dict_registry) {
+  u64 content_len = 0;
+
+  do {
+    Lz4::Frame::FrameReader& reader = stream.frame();
+    content_len += verify_frame(reader, dict_registry.find_for_frame(reader.descriptor()));
+  } while(Lz4::Parse::next_frame(stream));
+
+  return content_len;
+}
+
+// Mapping length for decoding a whole frame - the content size if the frame has one,
+//   else a bound from the number of blocks. The content size is not trusted beyond the
+//   bound.
+size_t mapped_out_len(const Lz4::Frame::FrameReader& reader) {
+  const Lz4::Frame::Descriptor& descriptor = reader.descriptor();
+  size_t bound = Lz4::Parse::scan_blocks(reader).size() * descriptor.bd_block_max_bytes();
+
+  if(descriptor.flg_is_set(Lz4::Frame::Flg::CONTENT_SIZE_FLAG) && descriptor.content_size < bound) {
+    return (size_t)descriptor.content_size;
+  }
+  return bound;
+}
+
+// Mapping length for decoding every frame from the current frame of stream to the end.
+size_t mapped_out_len(Lz4::Frame::StreamReader stream) {
+  size_t len = 0;
+
+  do {
+    len += mapped_out_len(stream.frame());
+  } while(Lz4::Parse::next_frame(stream));
+
+  return len;
+}
+
+// Decode a whole frame block by block straight into out, with matches of linked blocks
+//   reaching back into the earlier output of the frame in the mapping - no window is copied.
+// Independent blocks without a dictionary use the decoder specialised for the frame block
+//   max size and checks - with a content checksum only if the input is trusted, as the
+//   hashing decoders are all hardened.
+// @return content length
+u64 decode_frame_mapped(Lz4::Frame::FrameReader& reader, std::shared_ptr<const Lz4::Dict::Dictionary> dict, const Lz4::Decode::Checks checks, u8* const out_start, const size_t out_len) {
+  const Lz4::Frame::Descriptor& descriptor = reader.descriptor();
+  const bool linked = !descriptor.flg_is_set(Lz4::Frame::Flg::BLOCK_INDEP_FLAG);
+  const bool hashed = descriptor.flg_is_set(Lz4::Frame::Flg::CONTENT_CHECKSUM_FLAG);
+  const size_t block_max_bytes = descriptor.bd_block_max_bytes();
+
+  lz4_decode_block_fn* const block_decoder = linked || dict || (hashed && checks != Lz4::Decode::Checks::TRUSTED)
+    ? nullptr : Lz4::Decode::select_block_decoder(block_max_bytes, checks);
+
+  // With no prefix - the first block, or any independent block - this is a plain
+  //   dictionary decode, and with no dictionary a plain prefix decode.
+  const u8* dict_data = dict ? dict->data() : 0;
+  const size_t dict_len = dict ? dict->len() : 0;
+
+  xxh32_state content_hash;
+  xxh32_init(&content_hash, 0);
+
+  size_t out_pos = 0;
+  Lz4::Frame::BlockView block;
+
+  while(Lz4::Parse::next_block(reader, &block)) {
+    const u32 data_len = block.len;
+
+    Lz4::Parse::verify_block_checksum(block);
+
+    u8* block_out = out_start + out_pos;
+    // Room for the block, which is no more than the block max size
+    size_t block_room = std::min(block_max_bytes, out_len - out_pos);
+    size_t raw_len;
+
+    if(block.compressed) {
+      size_t prefix_len = linked ? out_pos : 0;
+      ssize_t rc = block_decoder
+	? block_decoder(block_out, block_room, block.data, data_len)
+	: hashed
+	? lz4_decode_block_with_prefix_dict_hash(block_out, block_room, block.data, data_len, prefix_len, dict_data, dict_len, &content_hash)
+	: lz4_decode_block_with_prefix_dict(block_out, block_room, block.data, data_len, prefix_len, dict_data, dict_len);
+      if(rc < 0) {
+	throw std::string(rc == -LZ4_DECODE_ERR_OUTPUT_OVERFLOW && block_room < block_max_bytes ? "Content is larger than the frame content size" : "Block decode failed");
+      }
+      raw_len = (size_t)rc;
+
+      if(hashed && block_decoder) {
+	xxh32_update(&content_hash, block_out, raw_len);
+      }
+    } else {
+      if(data_len > block_room) {
+	throw std::string("Content is larger than the frame content size");
+      }
+      memcpy(block_out, block.data, data_len);
+      raw_len = data_len;
+
+      if(hashed) {
+	xxh32_update(&content_hash, block_out, raw_len);
+      }
+    }
+
+    out_pos += raw_len;
+  }
+
+  if(hashed && xxh32_digest(&content_hash) != reader.content_checksum()) {
+    throw std::string("Content checksum mismatch");
+  }
+
+  if(descriptor.flg_is_set(Lz4::Frame::Flg::CONTENT_SIZE_FLAG) && out_pos != descriptor.content_size) {
+    throw std::string("Content size mismatch");
+  }
+
+  return out_pos;
+}
+
+// Decode every frame from the current frame of stream to the end into out, one after
+//   another, each with the decoder picked for it. The output file, if any, is trimmed to
+//   the content length.
+// @return content length
+u64 decode_stream_mapped(Lz4::Frame::StreamReader& stream, const Lz4::Dict::Registry& dict_registry, const Lz4::Decode::Checks checks, Lz4::Decode::MappedOutput& out) {
+  size_t out_pos = 0;
+
+  do {
+    Lz4::Frame::FrameReader& reader = stream.frame();
+    out_pos += decode_frame_mapped(reader, dict_registry.find_for_frame(reader.descriptor()), checks, out.data() + out_pos, out.len() - out_pos);
+  } while(Lz4::Parse::next_frame(stream));
+
+  out.truncate(out_pos);
+
+  return out_pos;
+}
+
+// Seek index for the frame - from the sidecar index_file if there is one, else from an
+//   index trailer at the end of the input, else built by walking the block headers.
+// @return where the index came from
+const char* load_seek_index(Lz4::Index::SeekIndex& index, const Lz4::Frame::FrameReader& reader, const char* index_file, const u8* buf, size_t buf_len) {
+  if(index_file) {
+    Util::MappedFile file(index_file);
+    Lz4::Parse::throw_if_error(index.load(file.data(), file.len()));
+    return "sidecar";
+  }
+
+  Lz4::Frame::Error error = index.load_trailer(buf, buf_len);
+  if(error == Lz4::Frame::Error::OK) {
+    return "trailer";
+  }
+  if(error != Lz4::Frame::Error::INDEX_BAD_MAGIC) {
+    Lz4::Parse::throw_if_error(error);
+  }
+
+  Lz4::Parse::throw_if_error(index.build(reader));
+  return "built";
+}
+
+// Write data to filepath - appended to the end of the file if append is set.
+void write_file(const char* filepath, const std::string& data, bool append) {
+  FILE* file = fopen(filepath, append ? "ab" : "wb");
+  if(!file) {
+    throw std::string("Cannot open ") + filepath + ": " + strerror(errno);
+  }
+  size_t n = fwrite(data.data(), 1, data.length(), file);
+  if(fclose(file) != 0 || n != data.length()) {
+    throw std::string("Cannot write ") + filepath;
+  }
+}
+
+// Time a random access read of len bytes of content at offset, through the seek index of
+//   the frame at the start of buf.
+void time_seek_read(const Lz4::Index::SeekIndex& index, const u8* buf, size_t buf_len, std::shared_ptr<const Lz4::Dict::Dictionary> dict, u64 offset, size_t len) {
+  Lz4::Index::SeekableReader seekable;
+  Lz4::Parse::throw_if_error(seekable.open(buf, buf_len, &index, dict ? dict->data() : 0, dict ? dict->len() : 0));
+
+  std::unique_ptr<u8[]> out(new u8[len]);
+  size_t read_len;
+
+  auto t0 = Time::now();
+  Lz4::Parse::throw_if_error(seekable.pread_uncompressed(out.get(), len, offset, &read_len));
+  dsec ds0 = Time::now() - t0;
+
+  size_t first_block = index.find(offset);
+  size_t n_blocks = read_len == 0 ? 0 : index.find(offset + read_len - 1) - first_block + 1;
+
+  printf("read %zu bytes at offset %lu from %zu blocks in %7.3lfms - xxh32 0x%08x\n", read_len, offset, n_blocks, ds0.count()*ms_per_s, xxh32(out.get(), read_len, 0));
+}
+
+// Time the same random access read through a block cache of cache_bytes, by n_threads
+//   readers at once - first with the cache cold, where concurrent misses on a block
+//   should decode it only once, and then warm.
+void time_cached_seek_read(const Lz4::Index::SeekIndex& index, const u8* buf, size_t buf_len, std::shared_ptr<const Lz4::Dict::Dictionary> dict, u64 offset, size_t len, size_t cache_bytes, unsigned n_threads) {
+  Lz4::Frame::Header header;
+  Lz4::Parse::throw_if_error(Lz4::Frame::parse_header(buf, buf_len, &header));
+
+  Lz4::Cache::BlockCache cache(cache_bytes, header.descriptor.bd_block_max_bytes());
+  const u64 file_id = cache.add_file();
+
+  std::vector<Lz4::Index::SeekableReader> readers(n_threads);
+  std::vector<std::unique_ptr<u8[]>> outs(n_threads);
+  for(unsigned t = 0; t < n_threads; t++) {
+    Lz4::Parse::throw_if_error(readers[t].open(buf, buf_len, &index, dict ? dict->data() : 0, dict ? dict->len() : 0));
+    Lz4::Parse::throw_if_error(readers[t].use_cache(&cache, file_id));
+    outs[t].reset(new u8[len]);
+  }
+
+  for(const char* pass : { "cold", "warm" }) {
+    std::vector<Lz4::Frame::Error> errors(n_threads);
+    std::vector<size_t> read_lens(n_threads);
+
+    auto t0 = Time::now();
+
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < n_threads; t++) {
+      threads.emplace_back([&, t]() {
+	  errors[t] = readers[t].pread_uncompressed(outs[t].get(), len, offset, &read_lens[t]);
+	});
+    }
+    for(std::thread& thread : threads) {
+      thread.join();
+    }
+
+    dsec ds0 = Time::now() - t0;
+
+    for(unsigned t = 0; t < n_threads; t++) {
+      Lz4::Parse::throw_if_error(errors[t]);
+    }
+
+    Lz4::Cache::Stats stats = cache.stats();
+    printf("%s cached read %zu bytes at offset %lu by %2u threads in %7.3lfms - xxh32 0x%08x - cache %lu hits %lu waits %lu decodes %lu evictions, %lu blocks %lu bytes\n",
+	   pass, read_lens[0], offset, n_threads, ds0.count()*ms_per_s, xxh32(outs[0].get(), read_lens[0], 0),
+	   stats.hits, stats.waits, stats.decodes, stats.evictions, stats.blocks, stats.bytes);
+  }
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "%s [-D [<dict-id>=]<dict-file>]... [-j <threads>] [-m | -o <out-file>] [-s <stats-sample-rate>] [-T] [-t]\n"
+	  "    [-x <index-file> | -X | [-i <index-file>] [-c <cache-MiB>] -r <offset>:<len>] <in-file>\n", prog);
+  exit(1);
+}
+
 int main(int argc, char* argv[]) {
-  if(argc != 2) {
-    fprintf(stderr, "%s <in-file>\n", argv[0]);
-    exit(1);
+  Lz4::Dict::Registry dict_registry;
+
+  // Threads for parallel decode of independent-block frames
+  unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  // Input checking of the specialised decoders
+  Lz4::Decode::Checks checks = Lz4::Decode::Checks::HARDENED;
+
+  // Only verify the frame, in bounded memory
+  bool verify_only = false;
+
+  // Only decode the frame into a mapping - of out_file, or anonymous if it is 0
+  bool mapped_only = false;
+  const char* out_file = 0;
+
+  // Seek index - write a sidecar index file, or append it to the input as a trailer
+  const char* write_index_file = 0;
+  bool append_index = false;
+  // Random access read of read_len bytes at read_offset, with the index in index_file
+  //   if given, else the index trailer of the input or an index built on the fly
+  const char* index_file = 0;
+  bool seek_read = false;
+  u64 read_offset = 0;
+  size_t read_len = 0;
+  // Decoded block cache for the random access read - 0 for none
+  size_t cache_mib = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "c:D:i:j:mo:r:s:TtXx:")) != -1) {
+    switch(opt) {
+    case 'D': {
+      // Dictionary for frames with the given dict-id, or for frames with no dict-id
+      std::string arg(optarg);
+      size_t eq = arg.find('=');
+      u32 dict_id = Lz4::Dict::Registry::NO_DICT_ID;
+      if(eq != std::string::npos) {
+	dict_id = (u32)strtoul(arg.substr(0, eq).c_str(), 0, 0);
+	arg = arg.substr(eq + 1);
+      }
+      try {
+	dict_registry.load(dict_id, arg);
+      }
+      catch(const std::string msg) {
+	fprintf(stderr, "%s\n", msg.c_str());
+	exit(1);
+      }
+      break;
+    }
+    case 'c':
+      cache_mib = strtoull(optarg, 0, 0);
+      break;
+    case 'i':
+      index_file = optarg;
+      break;
+    case 'j':
+      n_threads = std::max(1, atoi(optarg));
+      break;
+    case 'm':
+      mapped_only = true;
+      out_file = 0;
+      break;
+    case 'o':
+      mapped_only = true;
+      out_file = optarg;
+      break;
+    case 'r': {
+      char* colon;
+      read_offset = strtoull(optarg, &colon, 0);
+      if(*colon != ':') {
+	usage(argv[0]);
+      }
+      read_len = strtoull(colon + 1, 0, 0);
+      seek_read = true;
+      break;
+    }
+    case 's':
+      // Sample 1 in every n decoder loop calls - about one per block, not per sequence -
+      //   for decoder statistics, if built with them. All sequences of a sampled call count.
+      lz4_decode_stats_set_sample_rate((u32)strtoul(optarg, 0, 0));
+      break;
+    case 'T':
+      // Input is trusted to be well-formed - for the decoders specialised for the block
+      //   max size. -t always verifies with the hardened ring decoder.
+      checks = Lz4::Decode::Checks::TRUSTED;
+      break;
+    case 't':
+      verify_only = true;
+      break;
+    case 'X':
+      append_index = true;
+      break;
+    case 'x':
+      write_index_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if(optind != argc - 1) {
+    usage(argv[0]);
   }
 
   auto t0 = Time::now();
   
-  char* buf_file = argv[1];
-  std::string buf_str = Util::slurp(buf_file);
+  char* buf_file = argv[optind];
+  // Verify and mapped decode read the input once; the benchmarks read it over and over.
+  std::unique_ptr<Util::MappedFile> in_file;
+  try {
+    in_file.reset(new Util::MappedFile(buf_file, verify_only || mapped_only ? Util::MappedFile::SEQUENTIAL | Util::MappedFile::WILLNEED : Util::MappedFile::WILLNEED));
+  }
+  catch(const std::string msg) {
+    fprintf(stderr, "%s\n", msg.c_str());
+    exit(1);
+  }
 
-  const u8* buf = (const u8*)buf_str.c_str();
-  size_t buf_len = buf_str.length();
+  const u8* buf = in_file->data();
+  size_t buf_len = in_file->len();
 
   auto t1 = Time::now();
   dsec ds1 = t1 - t0;
@@ -355,73 +1310,221 @@ int main(int argc, char* argv[]) {
   printf("Read %s length %zu in %7.3lfms\n", buf_file, buf_len, secs1*1000.0);
 
   try {
-    Lz4::Frame::Header header = Lz4::Parse::parse_header(buf, buf_len);
+    // Leading skippable frames are passed over - the rest of the stream is only read by
+    //   -t, -o and -m, the other modes use the first frame.
+    Lz4::Frame::StreamReader stream;
+    stream.open(buf, buf_len);
+    if(!Lz4::Parse::next_frame(stream)) {
+      throw std::string("No lz4 frame in input");
+    }
+
+    Lz4::Frame::FrameReader reader = stream.frame();
+    const Lz4::Frame::Header& header = reader.header();
 
     printf("lz4 header: len %zu magic 0x%04x descriptor flg 0x%02x bd 0x%02x content-size %lu dict-id %u hc 0x%02x\n",
 	   header.len, header.magic, header.descriptor.flg, header.descriptor.bd,
 	   header.descriptor.content_size, header.descriptor.dict_id, header.descriptor.hc);
 
-    buf += header.len;
-    buf_len -= header.len;
-    
-    for(int block_no = 0;; block_no++) {
-      Lz4::Block::Header block_header = Lz4::Parse::parse_block_header(buf, buf_len);
+    std::shared_ptr<const Lz4::Dict::Dictionary> dict = dict_registry.find_for_frame(header.descriptor);
+
+    if(verify_only) {
+      auto t2 = Time::now();
+      u64 content_len = verify_stream(stream, dict_registry);
+      dsec ds2 = Time::now() - t2;
 
-      printf("  block %d: is-endmark %s is-compressed %s data-length %u\n", block_no, (block_header.is_endmark() ? "true" : "false"), (block_header.is_compressed() ? "true" : "false"), block_header.data_length());
-      if(block_header.is_endmark()) {
-	buf += sizeof(Lz4::Block::Header::block_size);
-	buf_len -= sizeof(Lz4::Block::Header::block_size);
-	break;
+      printf("verified %lu bytes of content in %zu frames (%zu skippable) with a %u byte ring in %7.3lfms\n", content_len, stream.frames(), stream.skippable_frames(), LZ4_RING_DECODE_BUF_LEN, ds2.count()*ms_per_s);
+      return 0;
+    }
+
+    if(write_index_file || append_index) {
+      Lz4::Index::SeekIndex existing;
+      if(append_index && existing.load_trailer(buf, buf_len) == Lz4::Frame::Error::OK) {
+	throw std::string("Input already has an index trailer");
       }
 
-      buf += sizeof(Lz4::Block::Header::block_size);
-      buf_len -= sizeof(Lz4::Block::Header::block_size);
+      auto t2 = Time::now();
+      Lz4::Index::SeekIndex index;
+      Lz4::Parse::throw_if_error(index.build(reader));
+      dsec ds2 = Time::now() - t2;
+
+      printf("indexed %zu blocks, %lu bytes of content in %7.3lfms\n", index.n_blocks(), index.content_len(), ds2.count()*ms_per_s);
+
+      std::string index_data;
+      if(write_index_file) {
+	index.serialise(index_data);
+	write_file(write_index_file, index_data, false);
+      } else {
+	index.serialise_trailer(index_data);
+	// The mapping of the input is not used again
+	write_file(buf_file, index_data, true);
+      }
+      printf("wrote %zu byte index to %s\n", index_data.length(), write_index_file ? write_index_file : buf_file);
+      return 0;
+    }
+
+    if(seek_read) {
+      auto t2 = Time::now();
+      Lz4::Index::SeekIndex index;
+      const char* index_source = load_seek_index(index, reader, index_file, buf, buf_len);
+      dsec ds2 = Time::now() - t2;
 
-      size_t block_size = block_header.data_length() + (header.descriptor.flg_is_set(Lz4::Frame::Flg::BLOCK_CHECKSUM_FLAG) ? 4 : 0);
+      printf("%s index of %zu blocks, %lu bytes of content in %7.3lfms\n", index_source, index.n_blocks(), index.content_len(), ds2.count()*ms_per_s);
 
-      if(buf_len < block_size) {
-	throw std::string("Block size is greater than remaining buffer");
+      // The index describes the first frame, which need not be at the start of the input
+      time_seek_read(index, reader.start(), reader.buf_len(), dict, read_offset, read_len);
+      if(cache_mib != 0) {
+	time_cached_seek_read(index, reader.start(), reader.buf_len(), dict, read_offset, read_len, cache_mib << 20, n_threads);
       }
+      return 0;
+    }
 
-      if(block_header.is_compressed()) {
-	show_sequences(buf, block_header.data_length());
+    if(mapped_only) {
+      auto t2 = Time::now();
+      Lz4::Decode::MappedOutput out(out_file, mapped_out_len(stream));
+      dsec ds2 = Time::now() - t2;
 
-	// Warm up decode
-	static u8 out_buf[4*1024*1024];
-	//ssize_t raw_len = lz4_decode_block_default(out_buf, sizeof(out_buf), buf, block_header.data_length());
-	ssize_t raw_len = lz4_decode_block_fast(out_buf, sizeof(out_buf), buf, block_header.data_length());
-	printf("    block %d: decode-len %ld\n", block_no, raw_len);
+      auto t3 = Time::now();
+      u64 content_len = decode_stream_mapped(stream, dict_registry, checks, out);
+      dsec ds3 = Time::now() - t3;
 
-	if(raw_len >= 0) {
-	  // Time decode
-	  auto t0 = Time::now();
-	  
-	  const unsigned n_iters = 256;
-	  for(unsigned i = 0; i < n_iters; i++) {
-	    //ssize_t raw_len2 = lz4_decode_block_default(out_buf, sizeof(out_buf), buf, block_header.data_length());
-	    ssize_t raw_len2 = lz4_decode_block_fast(out_buf, sizeof(out_buf), buf, block_header.data_length());
-	    if(raw_len2 != raw_len) {
-	      printf("                      abort bad raw len %ld expecting %ld\n", raw_len2, raw_len);
-	      break;
-	    }
+      double secs3 = ds3.count();
+      printf("mapped %zu bytes of %s in %7.3lfms\n", out.len(), out_file ? out_file : "anonymous memory", ds2.count()*ms_per_s);
+      printf("decoded %lu bytes of content from %zu frames (%zu skippable) into the mapping in %7.3lfms - %10.3lfMiB/s\n", content_len, stream.frames(), stream.skippable_frames(), secs3*ms_per_s, (double)content_len/MiB / secs3);
+      return 0;
+    }
+
+    Lz4::Decode::FrameDecoder frame_decoder(header.descriptor, dict, checks);
+    
+    Lz4::Frame::FrameReader blocks_reader = reader;
+    Lz4::Frame::BlockView block;
+
+    for(int block_no = 0; Lz4::Parse::next_block(blocks_reader, &block); block_no++) {
+      printf("  block %d: is-compressed %s data-length %u\n", block_no, (block.compressed ? "true" : "false"), block.len);
+
+      if(block.compressed) {
+	show_sequences(block.data, block.len);
+
+	u8* out_buf = frame_decoder.block_out();
+	size_t out_buf_len = frame_decoder.block_out_len();
+
+	if(frame_decoder.is_linked() || frame_decoder.has_dict()) {
+	  time_decode(frame_decoder.is_linked() ? "prefix" : "dict", [&frame_decoder](void* out, size_t out_len, const void* in, size_t in_len) {
+	      return frame_decoder.decode_compressed(out, out_len, in, in_len);
+	    }, out_buf, out_buf_len, block.data, block.len);
+	} else {
+	  time_decode("fast", lz4_decode_block_fast, out_buf, out_buf_len, block.data, block.len);
+
+	  lz4_prefetch_stats prefetch_stats = {};
+	  if(time_decode("prefetch", [&prefetch_stats](void* out, size_t out_len, const void* in, size_t in_len) {
+		prefetch_stats = {};
+		return lz4_decode_block_fast_prefetch(out, out_len, in, in_len, &prefetch_stats);
+	      }, out_buf, out_buf_len, block.data, block.len) >= 0) {
+	    printf("             %lu sequences scouted, %lu far prefetches - sampled first match loads %.1lf cycles prefetched (%lu), %.1lf cycles not (%lu)\n",
+		   prefetch_stats.sequences_scouted, prefetch_stats.far_prefetches,
+		   prefetch_stats.prefetched_samples ? (double)prefetch_stats.prefetched_cycles/prefetch_stats.prefetched_samples : 0.0, prefetch_stats.prefetched_samples,
+		   prefetch_stats.control_samples ? (double)prefetch_stats.control_cycles/prefetch_stats.control_samples : 0.0, prefetch_stats.control_samples);
+	  }
+
+	  time_decode(lz4_decode_block_simd_name(), lz4_decode_block_simd, out_buf, out_buf_len, block.data, block.len);
+
+	  time_decode("2-phase", lz4_decode_block_two_phase, out_buf, out_buf_len, block.data, block.len);
+
+	  time_decode("table", lz4_decode_block_table, out_buf, out_buf_len, block.data, block.len);
+
+	  size_t block_max_bytes = header.descriptor.bd_block_max_bytes();
+	  // Not specialised for legacy frames
+	  if(Lz4::Decode::select_block_decoder(block_max_bytes, checks)) {
+	    time_decode("tmpl-16", Lz4::Decode::select_block_decoder(block_max_bytes, checks, 16), out_buf, out_buf_len, block.data, block.len);
+	    time_decode("tmpl-32", Lz4::Decode::select_block_decoder(block_max_bytes, checks, 32), out_buf, out_buf_len, block.data, block.len);
+	  }
+
+	  // In-place - the compressed block is first copied to the tail of its own output
+	  //   buffer, as if it had been read there straight from disk.
+	  size_t in_place_len = LZ4_DECODE_IN_PLACE_BUF_LEN(block_max_bytes, block.len);
+	  std::unique_ptr<u8[]> in_place_buf(new u8[in_place_len]);
+	  time_decode("in-place", [](void* out, size_t out_len, const void* in, size_t in_len) {
+	      memcpy((u8*)out + out_len - in_len, in, in_len);
+	      return lz4_decode_block_in_place(out, out_len, in_len);
+	    }, in_place_buf.get(), in_place_len, block.data, block.len);
+
+	  // Scatter output - 4KiB pages taken from a buffer twice the size in reverse
+	  //   order, so that no two consecutive pages are adjacent.
+	  const size_t page_len = 4*KiB;
+	  size_t n_pages = (block_max_bytes + page_len - 1) / page_len;
+	  std::unique_ptr<u8[]> pages_buf(new u8[2*n_pages*page_len]);
+	  std::vector<struct iovec> pages(n_pages);
+	  for(size_t i = 0; i < n_pages; i++) {
+	    pages[i].iov_base = pages_buf.get() + 2*(n_pages - 1 - i)*page_len;
+	    pages[i].iov_len = page_len;
 	  }
-	  auto t1 = Time::now();
-	  dsec ds1 = t1 - t0;
-	  double secs1 = ds1.count();
-	  
-	  double ms = secs1 * ms_per_s;
-	  size_t copy_len = (size_t)raw_len;
-	  double mib_per_s = copy_len*n_iters/MiB / secs1;
-	  
-	  printf("decompressed %zu bytes %u times in %9.3lfms - %10.3lfMiB/s\n", copy_len, n_iters, ms, mib_per_s);
+	  time_decode("iov-4k", [&pages](void* out, size_t out_len, const void* in, size_t in_len) {
+	      return lz4_decode_block_iov(pages.data(), (int)pages.size(), in, in_len);
+	    }, out_buf, out_buf_len, block.data, block.len);
 	}
+
+	if(!frame_decoder.has_dict()) {
+	  size_t prefix_len = frame_decoder.prefix_len();
+	  time_decode("stream", [prefix_len](void* out, size_t out_len, const void* in, size_t in_len) {
+	      return stream_decode_block(out, out_len, (const u8*)in, in_len, prefix_len, 4*KiB);
+	    }, out_buf, out_buf_len, block.data, block.len);
+	}
+
+	// Content checksum - fused decode-and-hash against decode then hash the whole block
+	time_decode("hash", [&frame_decoder](void* out, size_t out_len, const void* in, size_t in_len) {
+	    xxh32_state state;
+	    xxh32_init(&state, 0);
+	    return frame_decoder.decode_compressed_hash(out, out_len, in, in_len, &state);
+	  }, out_buf, out_buf_len, block.data, block.len);
+
+	time_decode("2-pass", [&frame_decoder](void* out, size_t out_len, const void* in, size_t in_len) {
+	    ssize_t raw_len = frame_decoder.decode_compressed(out, out_len, in, in_len);
+	    if(raw_len > 0) {
+	      xxh32(out, raw_len, 0);
+	    }
+	    return raw_len;
+	  }, out_buf, out_buf_len, block.data, block.len);
       }
 
-      buf += block_size;
-      buf_len -= block_size;
+      size_t raw_len = frame_decoder.decode_block(block);
+      printf("    block %d: decode-len %zu\n", block_no, raw_len);
+    }
+
+    if(frame_decoder.has_content_checksum()) {
+      frame_decoder.verify_content_checksum(blocks_reader.content_checksum());
+      printf("  content checksum 0x%08x ok\n", blocks_reader.content_checksum());
     }
 
-    printf("buf len left %lu\n", buf_len);
+    printf("buf len left %lu\n", buf_len - blocks_reader.frame_len());
+
+    if(lz4_decode_stats_enabled()) {
+      lz4_decode_stats stats;
+      lz4_decode_stats_snapshot(&stats);
+      print_decode_stats("block decoders", stats);
+    }
+
+    if(header.descriptor.flg_is_set(Lz4::Frame::Flg::BLOCK_INDEP_FLAG)) {
+      std::vector<Lz4::Frame::BlockView> blocks = Lz4::Parse::scan_blocks(reader);
+      Lz4::Decode::ParallelFrameDecoder parallel_decoder(header.descriptor, dict, checks);
+      std::unique_ptr<u8[]> out(new u8[parallel_decoder.out_len(blocks)]);
+
+      time_parallel_decode(parallel_decoder, blocks, out.get(), 1);
+      if(n_threads > 1) {
+	time_parallel_decode(parallel_decoder, blocks, out.get(), n_threads);
+      }
+
+      if(lz4_decode_stats_enabled()) {
+	print_decode_stats("parallel decode", parallel_decoder.stats());
+      }
+
+      if(!dict) {
+	for(size_t n_interleave = 1; n_interleave <= LZ4_INTERLEAVE_MAX; n_interleave++) {
+	  time_interleaved_decode(blocks, header.descriptor.bd_block_max_bytes(), out.get(), n_interleave);
+	}
+	for(size_t n_interleave = 1; n_interleave <= LZ4_INTERLEAVE_MAX; n_interleave++) {
+	  time_batch_decode(blocks, header.descriptor.bd_block_max_bytes(), out.get(), n_interleave);
+	}
+      }
+    }
   }
   catch(const std::string msg) {
     printf("Error parsing lz4 frame: %s\n", msg.c_str());
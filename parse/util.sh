@@ -17,3 +17,5 @@ cat parse.out | awk '/ matches / { n_match_lines += 1; offset = $7; n_matches +=
 cat parse.out | awk '/ matches / { n_match_lines += 1; match_len = $5; offset = $7; n_matches += $5; if(match_len > 8) { n_matches_gt_8 += 1; n_offsets[offset] += 1; } } END { print NR, "lines", n_match_lines, "match lines", n_matches_gt_8, "matches > 8 bytes"; for(i = 0; i < 8; i += 1) { accum_n_offsets += n_offsets[i]; print "offset", i, "offset counts", n_offsets[i], n_offsets[i]/n_matches_gt_8, "accum", accum_n_offsets, accum_n_offsets/n_matches_gt_8} }'
 
 
+cat parse.out | awk '/ matches / { n_match_lines += 1; match_len = $5; offset = $7; if(offset < 16 && offset < match_len) { n_overlaps += 1; n_overlap_offsets[offset] += 1; } } END { print NR, "lines", n_match_lines, "match lines", n_overlaps, "overlaps with offset < 16"; for(i = 1; i < 16; i += 1) { print "overlap offset", i, "count", n_overlap_offsets[i], n_overlap_offsets[i]/n_overlaps } }'
+
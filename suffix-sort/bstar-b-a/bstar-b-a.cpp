@@ -414,10 +414,14 @@ namespace BstarBA {
 // exit()
 #include <cstdlib>
 
+// std::unique_ptr
+#include <memory>
+
 int main(int argc, char* argv[]) {
   printf("Hallo RPJ\n");
 
   std::string data_string;
+  std::unique_ptr<Util::MappedFile> data_file;
   bool do_lcp = false;
   bool show_suffixes = false;
 
@@ -427,11 +431,17 @@ int main(int argc, char* argv[]) {
     show_suffixes = true;
   } else {
     std::string filename = argv[1];
-    data_string = Util::slurp(filename);
+    try {
+      data_file.reset(new Util::MappedFile(filename, Util::MappedFile::WILLNEED));
+    }
+    catch(const std::string msg) {
+      fprintf(stderr, "%s\n", msg.c_str());
+      exit(1);
+    }
   }
   
-  const char* data = data_string.c_str();;
-  u32 len = data_string.length();
+  const char* data = data_file ? (const char*)data_file->data() : data_string.c_str();
+  u32 len = data_file ? data_file->len() : data_string.length();
 
   printf("Using data string of length %u bytes\n", len);
 
@@ -222,6 +222,9 @@ int simple_suffix_sort_with_lcp(const u8* data, const u32 len, u32* SA, u32* LCP
 // exit()
 #include <cstdlib>
 
+// std::unique_ptr
+#include <memory>
+
 int main(int argc, char* argv[]) {
   printf("Hallo RPJ\n");
 
@@ -229,6 +232,7 @@ int main(int argc, char* argv[]) {
   printf("u64 at offset 0 is 0x%016lx, u64 at offset 1 is 0x%016lx\n", u64_at_offset(u8s, 0), u64_at_offset(u8s, 1));
 
   std::string data_string;
+  std::unique_ptr<Util::MappedFile> data_file;
   bool do_lcp = false;
   bool show_suffixes = false;
 
@@ -238,11 +242,17 @@ int main(int argc, char* argv[]) {
     show_suffixes = true;
   } else {
     std::string filename = argv[1];
-    data_string = Util::slurp(filename);
+    try {
+      data_file.reset(new Util::MappedFile(filename, Util::MappedFile::WILLNEED));
+    }
+    catch(const std::string msg) {
+      fprintf(stderr, "%s\n", msg.c_str());
+      exit(1);
+    }
   }
   
-  const char* data = data_string.c_str();;
-  u32 len = data_string.length();
+  const char* data = data_file ? (const char*)data_file->data() : data_string.c_str();
+  u32 len = data_file ? data_file->len() : data_string.length();
 
   printf("Using data string of length %u bytes\n", len);
 
@@ -1,31 +1,120 @@
 #include "util.h"
 
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
-#include <fstream>
 #include <iostream>
-#include <streambuf>
 #include <string>
 #include <sstream>
 
 #include <byteswap.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace Util {
-    
-  std::string slurp(const std::string& filepath) {
-    std::ifstream t(filepath);
-    std::string str;
-    
-    t.seekg(0, std::ios::end);   
-    str.reserve(t.tellg());
-    t.seekg(0, std::ios::beg);
-    
-    str.assign((std::istreambuf_iterator<char>(t)),
-	       std::istreambuf_iterator<char>());
-    
-    return str;
+
+  // Read all of fd into buf with pread() - the file is len bytes long.
+  // @return false on a read error
+  static bool pread_all(const int fd, std::string& buf, const size_t len) {
+    buf.resize(len);
+
+    size_t pos = 0;
+    while(pos < len) {
+      ssize_t n = pread(fd, &buf[pos], len - pos, pos);
+      if(n < 0 && errno == EINTR) {
+	continue;
+      }
+      if(n <= 0) {
+	// Error, or the file shrank under us
+	buf.resize(pos);
+	return n == 0;
+      }
+      pos += n;
+    }
+    return true;
+  }
+
+  // Read fd to EOF - for files with no usable size, such as pipes.
+  // @return false on a read error
+  static bool read_all(const int fd, std::string& buf) {
+    const size_t chunk_len = 64*1024;
+    size_t pos = 0;
+
+    for(;;) {
+      buf.resize(pos + chunk_len);
+      ssize_t n = read(fd, &buf[pos], chunk_len);
+      if(n < 0 && errno == EINTR) {
+	continue;
+      }
+      if(n <= 0) {
+	buf.resize(pos);
+	return n == 0;
+      }
+      pos += n;
+    }
+  }
+
+  MappedFile::MappedFile(const std::string& filepath, const int advice)
+    : buf(0), buf_len(0), mapped(false) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if(fd < 0) {
+      throw std::string("Cannot open ") + filepath + ": " + strerror(errno);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+      int err = errno;
+      close(fd);
+      throw std::string("Cannot stat ") + filepath + ": " + strerror(err);
+    }
+
+    const bool sized = S_ISREG(st.st_mode) && st.st_size > 0;
+
+    if(sized) {
+      void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED) {
+	buf = (const u8*)p;
+	buf_len = st.st_size;
+	mapped = true;
+      }
+    }
+
+    if(mapped) {
+      // Advice only - failures are harmless.
+#ifdef MADV_HUGEPAGE
+      if(advice & HUGE_PAGES) {
+	madvise((void*)buf, buf_len, MADV_HUGEPAGE);
+      }
+#endif
+      if(advice & SEQUENTIAL) {
+	madvise((void*)buf, buf_len, MADV_SEQUENTIAL);
+      }
+      if(advice & WILLNEED) {
+	madvise((void*)buf, buf_len, MADV_WILLNEED);
+      }
+    } else {
+      bool ok = sized ? pread_all(fd, read_buf, st.st_size) : read_all(fd, read_buf);
+      if(!ok) {
+	int err = errno;
+	close(fd);
+	throw std::string("Cannot read ") + filepath + ": " + strerror(err);
+      }
+      buf = (const u8*)read_buf.data();
+      buf_len = read_buf.length();
+    }
+
+    // The mapping stays valid once the file is closed.
+    close(fd);
+  }
+
+  MappedFile::~MappedFile() {
+    if(mapped) {
+      munmap((void*)buf, buf_len);
+    }
   }
-  
+
 } // namespace Util
 
 // Should be in a C source file...